@@ -0,0 +1,642 @@
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <numeric>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#ifdef USE_OPENSSL_SHA
+#include <openssl/bn.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/param_build.h>
+#endif
+#endif
+
+#include "avb.hpp"
+#include "base_host.hpp"
+#include "boot_crypto.hpp"
+#include "bootimg.hpp"
+
+using namespace std;
+
+#define PADDING 15
+
+namespace {
+
+struct avb_algorithm {
+    const char *name;
+    SHA::Algorithm hash;
+    uint32_t key_bits;  // 0 when unsigned
+};
+
+// Indexed by AvbVBMetaImageHeader::algorithm_type
+constexpr avb_algorithm avb_algorithms[] = {
+    {"NONE", SHA::Algorithm::SHA256, 0},
+    {"SHA256_RSA2048", SHA::Algorithm::SHA256, 2048},
+    {"SHA256_RSA4096", SHA::Algorithm::SHA256, 4096},
+    {"SHA256_RSA8192", SHA::Algorithm::SHA256, 8192},
+    {"SHA512_RSA2048", SHA::Algorithm::SHA512, 2048},
+    {"SHA512_RSA4096", SHA::Algorithm::SHA512, 4096},
+    {"SHA512_RSA8192", SHA::Algorithm::SHA512, 8192},
+};
+
+inline uint64_t be64(uint64_t v) { return __builtin_bswap64(v); }
+inline uint32_t be32(uint32_t v) { return __builtin_bswap32(v); }
+
+bool sub_view(byte_view block, uint64_t off, uint64_t size, byte_view &out) {
+    if (off > block.size() || size > block.size() - off)
+        return false;
+    out = byte_view(block.data() + off, size);
+    return true;
+}
+
+// A vbmeta blob split into its blocks
+struct vbmeta_info {
+    AvbVBMetaImageHeader hdr;  // as stored, big-endian
+    uint32_t algorithm;
+    byte_view aux;
+    byte_view hash;
+    byte_view signature;
+    byte_view public_key;
+    byte_view public_key_metadata;
+    byte_view descriptors;
+};
+
+bool parse_vbmeta(byte_view blob, vbmeta_info &info) {
+    if (blob.size() < sizeof(AvbVBMetaImageHeader) || !BUFFER_MATCH(blob.data(), AVB_MAGIC)) {
+        fprintf(stderr, "avb: invalid vbmeta header\n");
+        return false;
+    }
+    memcpy(&info.hdr, blob.data(), sizeof(info.hdr));
+    const auto &h = info.hdr;
+    info.algorithm = be32(h.algorithm_type);
+    if (info.algorithm >= std::size(avb_algorithms)) {
+        fprintf(stderr, "avb: unsupported algorithm [%u]\n", info.algorithm);
+        return false;
+    }
+    byte_view body(blob.data() + sizeof(h), blob.size() - sizeof(h));
+    byte_view auth;
+    const uint64_t auth_size = be64(h.authentication_data_block_size);
+    if (!sub_view(body, 0, auth_size, auth) ||
+        !sub_view(body, auth_size, be64(h.auxiliary_data_block_size), info.aux) ||
+        !sub_view(auth, be64(h.hash_offset), be64(h.hash_size), info.hash) ||
+        !sub_view(auth, be64(h.signature_offset), be64(h.signature_size), info.signature) ||
+        !sub_view(info.aux, be64(h.public_key_offset), be64(h.public_key_size), info.public_key) ||
+        !sub_view(info.aux, be64(h.public_key_metadata_offset), be64(h.public_key_metadata_size),
+                  info.public_key_metadata) ||
+        !sub_view(info.aux, be64(h.descriptors_offset), be64(h.descriptors_size), info.descriptors)) {
+        fprintf(stderr, "avb: vbmeta block out of bounds\n");
+        return false;
+    }
+    return true;
+}
+
+// Locate the vbmeta blob of an image ending with an AVB footer
+bool find_vbmeta(byte_view img, AvbFooter &footer, byte_view &blob) {
+    if (img.size() < sizeof(AvbFooter)) {
+        fprintf(stderr, "avb: image too small\n");
+        return false;
+    }
+    const size_t footer_off = img.size() - sizeof(AvbFooter);
+    memcpy(&footer, img.data() + footer_off, sizeof(footer));
+    if (!BUFFER_MATCH(footer.magic.data(), AVB_FOOTER_MAGIC)) {
+        fprintf(stderr, "avb: no AVB footer\n");
+        return false;
+    }
+    if (!sub_view(byte_view(img.data(), footer_off), be64(footer.vbmeta_offset), be64(footer.vbmeta_size), blob)) {
+        fprintf(stderr, "avb: vbmeta out of bounds\n");
+        return false;
+    }
+    return true;
+}
+
+// Calls fn(offset, tag, bytes) for every descriptor; returns false if the list is malformed
+template <typename Fn>
+bool for_each_descriptor(byte_view descs, Fn &&fn) {
+    size_t off = 0;
+    while (off < descs.size()) {
+        AvbDescriptor d;
+        if (descs.size() - off < sizeof(d))
+            return false;
+        memcpy(&d, descs.data() + off, sizeof(d));
+        const uint64_t len = be64(d.num_bytes_following);
+        if (len % 8 || len > descs.size() - off - sizeof(d))
+            return false;
+        fn(off, be64(d.tag), byte_view(descs.data() + off, sizeof(d) + len));
+        off += sizeof(d) + len;
+    }
+    return true;
+}
+
+// A hash or hashtree descriptor: the fixed part, then partition name, salt and digest
+template <typename Desc>
+struct digest_descriptor {
+    Desc d;  // as stored, big-endian
+    SHA::Algorithm alg;
+    string_view partition;
+    byte_view salt;
+    size_t digest_off;  // from the start of the descriptor
+    size_t digest_len;
+};
+
+using hash_descriptor = digest_descriptor<AvbHashDescriptor>;
+using hashtree_descriptor = digest_descriptor<AvbHashtreeDescriptor>;
+
+template <typename Desc>
+bool parse_descriptor(byte_view raw, uint32_t Desc::*digest_len, digest_descriptor<Desc> &out) {
+    if (raw.size() < sizeof(Desc))
+        return false;
+    memcpy(&out.d, raw.data(), sizeof(Desc));
+    const size_t name_len = be32(out.d.partition_name_len);
+    const size_t salt_len = be32(out.d.salt_len);
+    out.digest_len = be32(out.d.*digest_len);
+    if (name_len + salt_len + out.digest_len > raw.size() - sizeof(Desc))
+        return false;
+
+    string_view alg(reinterpret_cast<const char *>(out.d.hash_algorithm.data()),
+                    strnlen(reinterpret_cast<const char *>(out.d.hash_algorithm.data()), out.d.hash_algorithm.size()));
+    if (alg == "sha1") {
+        out.alg = SHA::Algorithm::SHA1;
+    } else if (alg == "sha256") {
+        out.alg = SHA::Algorithm::SHA256;
+    } else if (alg == "sha512") {
+        out.alg = SHA::Algorithm::SHA512;
+    } else {
+        fprintf(stderr, "avb: unsupported hash algorithm [%.*s]\n", static_cast<int>(alg.size()), alg.data());
+        return false;
+    }
+
+    const uint8_t *p = raw.data() + sizeof(Desc);
+    out.partition = string_view(reinterpret_cast<const char *>(p), name_len);
+    out.salt = byte_view(p + name_len, salt_len);
+    out.digest_off = sizeof(Desc) + name_len + salt_len;
+    return true;
+}
+
+bool parse_descriptor(byte_view raw, hash_descriptor &out) {
+    return parse_descriptor(raw, &AvbHashDescriptor::digest_len, out);
+}
+
+bool parse_descriptor(byte_view raw, hashtree_descriptor &out) {
+    return parse_descriptor(raw, &AvbHashtreeDescriptor::root_digest_len, out);
+}
+
+vector<uint8_t> digest_of(SHA::Algorithm alg, byte_view a, byte_view b) {
+    SHA ctx(alg);
+    ctx.update(a);
+    ctx.update(b);
+    vector<uint8_t> out(ctx.output_size());
+    ctx.finalize_into(byte_data(out.data(), out.size()));
+    return out;
+}
+
+bool same(byte_view a, const vector<uint8_t> &b) {
+    return a.size() == b.size() && memcmp(a.data(), b.data(), b.size()) == 0;
+}
+
+// dm-verity hash tree over data, laid out like avbtool: levels stored top level first,
+// each padded to hash_block. Every level's blocks are hashed in parallel. Returns the
+// root digest, or nothing if data fits in a single block.
+vector<uint8_t> build_hashtree(SHA::Algorithm alg, byte_view salt, byte_view data,
+                               size_t data_block, size_t hash_block, vector<uint8_t> &tree) {
+    const size_t digest_size = alg == SHA::Algorithm::SHA1 ? 20 : alg == SHA::Algorithm::SHA256 ? 32 : 64;
+    // Digests are padded to a power of two
+    size_t stride = 1;
+    while (stride < digest_size)
+        stride <<= 1;
+
+    vector<size_t> level_sizes;
+    for (size_t size = data.size(), block = data_block; size > block; block = hash_block) {
+        size = align_to((size + block - 1) / block * stride, static_cast<int>(hash_block));
+        level_sizes.push_back(size);
+    }
+    tree.assign(accumulate(level_sizes.begin(), level_sizes.end(), size_t{0}), 0);
+    if (level_sizes.empty())
+        return {};
+
+    byte_view src = data;
+    size_t block = data_block;
+    size_t level_off = tree.size();
+    for (size_t level_size : level_sizes) {
+        level_off -= level_size;
+        uint8_t *out = tree.data() + level_off;
+        const size_t blocks = (src.size() + block - 1) / block;
+        const size_t chunks = min<size_t>(blocks, size_t{worker_threads()} * 8);
+        parallel_for(chunks, [&](size_t c) {
+            const vector<uint8_t> zeros(block);
+            for (size_t i = blocks * c / chunks; i < blocks * (c + 1) / chunks; ++i) {
+                const size_t len = min(block, src.size() - i * block);
+                SHA ctx(alg);
+                ctx.update(salt);
+                ctx.update(byte_view(src.data() + i * block, len));
+                ctx.update(byte_view(zeros.data(), block - len));
+                ctx.finalize_into(byte_data(out + i * stride, digest_size));
+            }
+        });
+        src = byte_view(out, level_size);
+        block = hash_block;
+    }
+    return digest_of(alg, salt, src);
+}
+
+// Rebuild the tree of a hashtree descriptor from img. Fails if the descriptor does not
+// describe a tree that fits inside img.
+bool rebuild_hashtree(byte_view img, const hashtree_descriptor &d, vector<uint8_t> &tree, vector<uint8_t> &root) {
+    const uint64_t image_size = be64(d.d.image_size);
+    const uint64_t tree_offset = be64(d.d.tree_offset);
+    const uint64_t tree_size = be64(d.d.tree_size);
+    const uint32_t data_block = be32(d.d.data_block_size);
+    const uint32_t hash_block = be32(d.d.hash_block_size);
+    if (image_size > img.size() || data_block == 0 || hash_block == 0 || tree_offset < image_size ||
+        tree_offset > img.size() || tree_size > img.size() - tree_offset)
+        return false;
+    root = build_hashtree(d.alg, d.salt, byte_view(img.data(), image_size), data_block, hash_block, tree);
+    return !root.empty() && tree.size() == tree_size && root.size() == d.digest_len;
+}
+
+#ifdef USE_OPENSSL_SHA
+
+using pkey_ptr = unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)>;
+using pkey_ctx_ptr = unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)>;
+using bn_ptr = unique_ptr<BIGNUM, decltype(&BN_free)>;
+
+const EVP_MD *evp_md(SHA::Algorithm alg) {
+    return alg == SHA::Algorithm::SHA512 ? EVP_sha512() : EVP_sha256();
+}
+
+// RSA public key from an AVB key blob (the exponent is always 65537)
+pkey_ptr decode_public_key(byte_view blob) {
+    pkey_ptr pkey(nullptr, EVP_PKEY_free);
+    AvbRSAPublicKeyHeader kh;
+    if (blob.size() < sizeof(kh))
+        return pkey;
+    memcpy(&kh, blob.data(), sizeof(kh));
+    const size_t len = be32(kh.key_num_bits) / 8;
+    if (len == 0 || blob.size() - sizeof(kh) < 2 * len)
+        return pkey;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    bn_ptr n(BN_bin2bn(blob.data() + sizeof(kh), static_cast<int>(len), nullptr), BN_free);
+    unique_ptr<OSSL_PARAM_BLD, decltype(&OSSL_PARAM_BLD_free)> bld(OSSL_PARAM_BLD_new(), OSSL_PARAM_BLD_free);
+    if (!n || !bld || !OSSL_PARAM_BLD_push_BN(bld.get(), OSSL_PKEY_PARAM_RSA_N, n.get()) ||
+        !OSSL_PARAM_BLD_push_ulong(bld.get(), OSSL_PKEY_PARAM_RSA_E, 65537))
+        return pkey;
+    unique_ptr<OSSL_PARAM, decltype(&OSSL_PARAM_free)> params(OSSL_PARAM_BLD_to_param(bld.get()), OSSL_PARAM_free);
+    pkey_ctx_ptr ctx(EVP_PKEY_CTX_new_from_name(nullptr, "RSA", nullptr), EVP_PKEY_CTX_free);
+    EVP_PKEY *key = nullptr;
+    if (params && ctx && EVP_PKEY_fromdata_init(ctx.get()) > 0 &&
+        EVP_PKEY_fromdata(ctx.get(), &key, EVP_PKEY_PUBLIC_KEY, params.get()) > 0)
+        pkey.reset(key);
+#else
+    BIGNUM *n = BN_bin2bn(blob.data() + sizeof(kh), static_cast<int>(len), nullptr);
+    BIGNUM *e = BN_new();
+    RSA *rsa = RSA_new();
+    if (!n || !e || !rsa || !BN_set_word(e, 65537) || !RSA_set0_key(rsa, n, e, nullptr)) {
+        BN_free(n);
+        BN_free(e);
+        RSA_free(rsa);
+        return pkey;
+    }
+    pkey.reset(EVP_PKEY_new());
+    if (!pkey || !EVP_PKEY_assign_RSA(pkey.get(), rsa)) {
+        RSA_free(rsa);
+        pkey.reset();
+    }
+#endif
+    return pkey;
+}
+
+// AVB key blob for an RSA key: bit count, -1/n mod 2^32, n, and R^2 mod n
+vector<uint8_t> encode_public_key(EVP_PKEY *pkey) {
+    bn_ptr n_bn(nullptr, BN_free), e_bn(nullptr, BN_free);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    BIGNUM *n_raw = nullptr, *e_raw = nullptr;
+    EVP_PKEY_get_bn_param(pkey, OSSL_PKEY_PARAM_RSA_N, &n_raw);
+    n_bn.reset(n_raw);
+    EVP_PKEY_get_bn_param(pkey, OSSL_PKEY_PARAM_RSA_E, &e_raw);
+    e_bn.reset(e_raw);
+#else
+    if (const RSA *rsa = EVP_PKEY_get0_RSA(pkey)) {
+        const BIGNUM *n_raw, *e_raw;
+        RSA_get0_key(rsa, &n_raw, &e_raw, nullptr);
+        n_bn.reset(BN_dup(n_raw));
+        e_bn.reset(BN_dup(e_raw));
+    }
+#endif
+    const BIGNUM *n = n_bn.get(), *e = e_bn.get();
+    if (!n || !e) {
+        fprintf(stderr, "avb: cannot read the RSA public key\n");
+        return {};
+    }
+    if (!BN_is_word(e, 65537)) {
+        fprintf(stderr, "avb: RSA public exponent must be 65537\n");
+        return {};
+    }
+    const int bits = BN_num_bits(n);
+    const size_t len = bits / 8;
+    vector<uint8_t> out(sizeof(AvbRSAPublicKeyHeader) + 2 * len);
+    uint8_t *n_buf = out.data() + sizeof(AvbRSAPublicKeyHeader);
+    BN_bn2binpad(n, n_buf, static_cast<int>(len));
+
+    const uint32_t n0 = (uint32_t{n_buf[len - 4]} << 24) | (uint32_t{n_buf[len - 3]} << 16) |
+                        (uint32_t{n_buf[len - 2]} << 8) | n_buf[len - 1];
+    // Newton's iteration doubles the correct low bits each step, starting from 3
+    uint32_t inv = n0;
+    for (int i = 0; i < 4; ++i)
+        inv *= 2 - n0 * inv;
+    AvbRSAPublicKeyHeader kh{be32(static_cast<uint32_t>(bits)), be32(0u - inv)};
+    memcpy(out.data(), &kh, sizeof(kh));
+
+    BN_CTX *ctx = BN_CTX_new();
+    BIGNUM *rr = BN_new();
+    bool ok = ctx && rr && BN_set_bit(rr, 2 * bits) && BN_mod(rr, rr, n, ctx) &&
+              BN_bn2binpad(rr, n_buf + len, static_cast<int>(len)) >= 0;
+    BN_free(rr);
+    BN_CTX_free(ctx);
+    if (!ok)
+        out.clear();
+    return out;
+}
+
+pkey_ptr load_private_key(const char *path) {
+    pkey_ptr pkey(nullptr, EVP_PKEY_free);
+    FILE *fp = xfopen(path, "r");
+    if (!fp)
+        return pkey;
+    pkey.reset(PEM_read_PrivateKey(fp, nullptr, nullptr, nullptr));
+    fclose(fp);
+    if (!pkey || EVP_PKEY_base_id(pkey.get()) != EVP_PKEY_RSA) {
+        fprintf(stderr, "avb: [%s] is not a PEM RSA private key\n", path);
+        pkey.reset();
+    }
+    return pkey;
+}
+
+bool rsa_verify(EVP_PKEY *pkey, SHA::Algorithm alg, const vector<uint8_t> &digest, byte_view sig) {
+    pkey_ctx_ptr ctx(EVP_PKEY_CTX_new(pkey, nullptr), EVP_PKEY_CTX_free);
+    return ctx && EVP_PKEY_verify_init(ctx.get()) > 0 &&
+           EVP_PKEY_CTX_set_rsa_padding(ctx.get(), RSA_PKCS1_PADDING) > 0 &&
+           EVP_PKEY_CTX_set_signature_md(ctx.get(), evp_md(alg)) > 0 &&
+           EVP_PKEY_verify(ctx.get(), sig.data(), sig.size(), digest.data(), digest.size()) == 1;
+}
+
+vector<uint8_t> rsa_sign(EVP_PKEY *pkey, SHA::Algorithm alg, const vector<uint8_t> &digest) {
+    pkey_ctx_ptr ctx(EVP_PKEY_CTX_new(pkey, nullptr), EVP_PKEY_CTX_free);
+    size_t len = 0;
+    if (!ctx || EVP_PKEY_sign_init(ctx.get()) <= 0 ||
+        EVP_PKEY_CTX_set_rsa_padding(ctx.get(), RSA_PKCS1_PADDING) <= 0 ||
+        EVP_PKEY_CTX_set_signature_md(ctx.get(), evp_md(alg)) <= 0 ||
+        EVP_PKEY_sign(ctx.get(), nullptr, &len, digest.data(), digest.size()) <= 0)
+        return {};
+    vector<uint8_t> sig(len);
+    if (EVP_PKEY_sign(ctx.get(), sig.data(), &len, digest.data(), digest.size()) <= 0)
+        return {};
+    sig.resize(len);
+    return sig;
+}
+
+#endif // USE_OPENSSL_SHA
+
+} // namespace
+
+int avb_verify(const char *image) {
+    mmap_data img(image);
+    AvbFooter footer;
+    byte_view blob;
+    vbmeta_info info;
+    if (!find_vbmeta(byte_view(img.data(), img.size()), footer, blob) || !parse_vbmeta(blob, info))
+        return 1;
+
+    const auto &alg = avb_algorithms[info.algorithm];
+    fprintf(stderr, "%-*s [%s]\n", PADDING, "AVB_ALGORITHM", alg.name);
+    bool ok = true;
+
+    bool valid = for_each_descriptor(info.descriptors, [&](size_t, uint64_t tag, byte_view raw) {
+        if (tag == AVB_DESCRIPTOR_TAG_HASHTREE) {
+            hashtree_descriptor d;
+            vector<uint8_t> tree, root;
+            const char *result = "OK";
+            if (!parse_descriptor(raw, d) || !rebuild_hashtree(byte_view(img.data(), img.size()), d, tree, root))
+                result = "INVALID";
+            else if (!same(byte_view(raw.data() + d.digest_off, d.digest_len), root))
+                result = "MISMATCH";
+            else if (!same(byte_view(img.data() + be64(d.d.tree_offset), tree.size()), tree))
+                result = "TREE MISMATCH";
+            ok &= strcmp(result, "OK") == 0;
+            fprintf(stderr, "%-*s [%.*s] %s\n", PADDING, "AVB_HASHTREE",
+                    static_cast<int>(d.partition.size()), d.partition.data(), result);
+            return;
+        }
+        if (tag != AVB_DESCRIPTOR_TAG_HASH)
+            return;
+        hash_descriptor d;
+        if (!parse_descriptor(raw, d)) {
+            ok = false;
+            return;
+        }
+        const uint64_t size = be64(d.d.image_size);
+        const char *result;
+        if (d.digest_len == 0) {
+            result = "PERSISTENT";
+        } else if (size > img.size()) {
+            result = "TRUNCATED";
+            ok = false;
+        } else {
+            bool match = same(byte_view(raw.data() + d.digest_off, d.digest_len),
+                              digest_of(d.alg, d.salt, byte_view(img.data(), size)));
+            result = match ? "OK" : "MISMATCH";
+            ok &= match;
+        }
+        fprintf(stderr, "%-*s [%.*s] %s\n", PADDING, "AVB_HASH",
+                static_cast<int>(d.partition.size()), d.partition.data(), result);
+    });
+    if (!valid) {
+        fprintf(stderr, "avb: malformed descriptors\n");
+        ok = false;
+    }
+
+    if (alg.key_bits == 0) {
+        fprintf(stderr, "%-*s [%s]\n", PADDING, "AVB_SIGNATURE", "NONE");
+        return ok ? 0 : 1;
+    }
+
+    // The signature covers the header and the auxiliary block
+    auto digest = digest_of(alg.hash, byte_view(blob.data(), sizeof(AvbVBMetaImageHeader)), info.aux);
+    bool hash_ok = same(info.hash, digest);
+    fprintf(stderr, "%-*s [%s]\n", PADDING, "AVB_VBMETA_HASH", hash_ok ? "OK" : "MISMATCH");
+    ok &= hash_ok;
+#ifdef USE_OPENSSL_SHA
+    auto pkey = decode_public_key(info.public_key);
+    bool sig_ok = pkey && rsa_verify(pkey.get(), alg.hash, digest, info.signature);
+    fprintf(stderr, "%-*s [%s]\n", PADDING, "AVB_SIGNATURE", sig_ok ? "OK" : "INVALID");
+    ok &= sig_ok;
+#else
+    fprintf(stderr, "%-*s [%s]\n", PADDING, "AVB_SIGNATURE", "UNCHECKED (no OpenSSL)");
+#endif
+    return ok ? 0 : 1;
+}
+
+int avb_sign(const char *image, const char *key) {
+    mmap_data img(image, true);
+    AvbFooter footer;
+    byte_view blob;
+    vbmeta_info info;
+    if (!find_vbmeta(byte_view(img.data(), img.size()), footer, blob) || !parse_vbmeta(blob, info))
+        return 1;
+
+    uint32_t algorithm = info.algorithm;
+    vector<uint8_t> public_key(info.public_key.data(), info.public_key.data() + info.public_key.size());
+#ifdef USE_OPENSSL_SHA
+    pkey_ptr pkey(nullptr, EVP_PKEY_free);
+#endif
+    if (key) {
+#ifdef USE_OPENSSL_SHA
+        pkey = load_private_key(key);
+        if (!pkey)
+            return 1;
+        public_key = encode_public_key(pkey.get());
+        if (public_key.empty())
+            return 1;
+        // Keep the digest of the current algorithm; the key decides the RSA size
+        const uint32_t bits = EVP_PKEY_bits(pkey.get());
+        const auto hash = avb_algorithms[algorithm].key_bits ? avb_algorithms[algorithm].hash : SHA::Algorithm::SHA256;
+        algorithm = 0;
+        for (uint32_t i = 1; i < std::size(avb_algorithms); ++i) {
+            if (avb_algorithms[i].hash == hash && avb_algorithms[i].key_bits == bits)
+                algorithm = i;
+        }
+        if (algorithm == 0) {
+            fprintf(stderr, "avb: unsupported RSA key size [%u]\n", bits);
+            return 1;
+        }
+#else
+        fprintf(stderr, "avb: signing requires a build with OpenSSL\n");
+        return 1;
+#endif
+    } else if (avb_algorithms[algorithm].key_bits) {
+        fprintf(stderr, "avb: vbmeta is signed with [%s], a key is required\n", avb_algorithms[algorithm].name);
+        return 1;
+    }
+    const auto &alg = avb_algorithms[algorithm];
+
+    // Refresh the hash descriptors over the image as it is now
+    const uint64_t image_size = be64(footer.original_image_size);
+    if (image_size > img.size()) {
+        fprintf(stderr, "avb: original image size out of bounds\n");
+        return 1;
+    }
+    vector<uint8_t> descs(info.descriptors.data(), info.descriptors.data() + info.descriptors.size());
+    bool ok = true;
+    bool valid = for_each_descriptor(byte_view(descs.data(), descs.size()), [&](size_t off, uint64_t tag, byte_view raw) {
+        if (tag == AVB_DESCRIPTOR_TAG_HASHTREE) {
+            // Write the tree back in place and drop FEC, which is not regenerated
+            hashtree_descriptor d;
+            vector<uint8_t> tree, root;
+            if (!parse_descriptor(raw, d) || !rebuild_hashtree(byte_view(img.data(), img.size()), d, tree, root) ||
+                be64(d.d.tree_offset) + tree.size() > be64(footer.vbmeta_offset)) {
+                ok = false;
+                return;
+            }
+            memcpy(img.data() + be64(d.d.tree_offset), tree.data(), tree.size());
+            const uint64_t fec_offset = be64(d.d.fec_offset);
+            const uint64_t fec_size = be64(d.d.fec_size);
+            if (fec_size && fec_offset <= be64(footer.vbmeta_offset) && fec_size <= be64(footer.vbmeta_offset) - fec_offset)
+                memset(img.data() + fec_offset, 0, fec_size);
+            d.d.fec_num_roots = 0;
+            d.d.fec_offset = 0;
+            d.d.fec_size = 0;
+            memcpy(descs.data() + off, &d.d, sizeof(d.d));
+            memcpy(descs.data() + off + d.digest_off, root.data(), root.size());
+            fprintf(stderr, "%-*s [%.*s] updated\n", PADDING, "AVB_HASHTREE",
+                    static_cast<int>(d.partition.size()), d.partition.data());
+            return;
+        }
+        if (tag != AVB_DESCRIPTOR_TAG_HASH)
+            return;
+        hash_descriptor d;
+        if (!parse_descriptor(raw, d)) {
+            ok = false;
+            return;
+        }
+        if (d.digest_len == 0)
+            return;
+        auto digest = digest_of(d.alg, d.salt, byte_view(img.data(), image_size));
+        if (digest.size() != d.digest_len) {
+            ok = false;
+            return;
+        }
+        d.d.image_size = be64(image_size);
+        memcpy(descs.data() + off, &d.d, sizeof(d.d));
+        memcpy(descs.data() + off + d.digest_off, digest.data(), digest.size());
+        fprintf(stderr, "%-*s [%.*s] updated\n", PADDING, "AVB_HASH",
+                static_cast<int>(d.partition.size()), d.partition.data());
+    });
+    if (!valid || !ok) {
+        fprintf(stderr, "avb: malformed descriptors\n");
+        return 1;
+    }
+
+    // Lay the blob out like avbtool: header, then hash + signature, then descriptors,
+    // public key and its metadata, each block padded to 64 bytes
+    const byte_view metadata = info.public_key_metadata;
+    vector<uint8_t> aux(descs);
+    aux.insert(aux.end(), public_key.begin(), public_key.end());
+    aux.insert(aux.end(), metadata.data(), metadata.data() + metadata.size());
+    aux.resize(align_to(aux.size(), 64));
+
+    const size_t hash_size = alg.key_bits ? (alg.hash == SHA::Algorithm::SHA512 ? 64 : 32) : 0;
+    const size_t sig_size = alg.key_bits / 8;
+    const size_t auth_size = align_to(hash_size + sig_size, 64);
+
+    AvbVBMetaImageHeader h = info.hdr;
+    h.authentication_data_block_size = be64(auth_size);
+    h.auxiliary_data_block_size = be64(aux.size());
+    h.algorithm_type = be32(algorithm);
+    h.hash_offset = 0;
+    h.hash_size = be64(hash_size);
+    h.signature_offset = be64(hash_size);
+    h.signature_size = be64(sig_size);
+    h.public_key_offset = be64(descs.size());
+    h.public_key_size = be64(public_key.size());
+    h.public_key_metadata_offset = be64(descs.size() + public_key.size());
+    h.public_key_metadata_size = be64(metadata.size());
+    h.descriptors_offset = 0;
+    h.descriptors_size = be64(descs.size());
+
+    vector<uint8_t> out(sizeof(h) + auth_size + aux.size());
+    memcpy(out.data(), &h, sizeof(h));
+    memcpy(out.data() + sizeof(h) + auth_size, aux.data(), aux.size());
+#ifdef USE_OPENSSL_SHA
+    if (alg.key_bits) {
+        auto digest = digest_of(alg.hash, byte_view(out.data(), sizeof(h)), byte_view(aux.data(), aux.size()));
+        auto sig = rsa_sign(pkey.get(), alg.hash, digest);
+        if (sig.size() != sig_size) {
+            fprintf(stderr, "avb: signing failed\n");
+            return 1;
+        }
+        memcpy(out.data() + sizeof(h), digest.data(), digest.size());
+        memcpy(out.data() + sizeof(h) + hash_size, sig.data(), sig.size());
+    }
+#endif
+
+    const uint64_t vbmeta_off = be64(footer.vbmeta_offset);
+    const size_t old_size = blob.size();
+    if (out.size() > img.size() - sizeof(AvbFooter) - vbmeta_off) {
+        fprintf(stderr, "avb: new vbmeta (%zu bytes) does not fit in the image\n", out.size());
+        return 1;
+    }
+    uint8_t *dst = img.data() + vbmeta_off;
+    memcpy(dst, out.data(), out.size());
+    if (old_size > out.size())
+        memset(dst + out.size(), 0, old_size - out.size());
+    footer.vbmeta_size = be64(out.size());
+    memcpy(img.data() + img.size() - sizeof(AvbFooter), &footer, sizeof(footer));
+
+    fprintf(stderr, "%-*s [%s]\n", PADDING, "AVB_ALGORITHM", alg.name);
+    return 0;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+// AVB 2.0 footer support: checks and refreshes the vbmeta appended to boot and partition images.
+
+// Verify the hash and hashtree descriptors of image against its contents, and the
+// vbmeta hash and signature. Prints one line per check; returns 0 when every check passed.
+int avb_verify(const char *image);
+
+// Recompute the hash descriptors and hash trees of image in place (FEC data is dropped,
+// not regenerated) and sign the vbmeta again with key, a PEM RSA private key. Without a key only unsigned (algorithm NONE) vbmeta can be
+// updated. Returns 0 on success.
+int avb_sign(const char *image, const char *key);
@@ -1,5 +1,12 @@
 #include "base_host.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
 #include <dirent.h>
 
 bool rm_rf(const char *path) {
@@ -28,6 +35,80 @@ bool rm_rf(const char *path) {
     return unlink(path) == 0;
 }
 
+unsigned worker_threads() {
+    static const unsigned threads = [] {
+        if (const char *env = getenv("MAGISKBOOT_THREADS")) {
+            char *end = nullptr;
+            unsigned long n = std::strtoul(env, &end, 10);
+            if (end != env && n > 0)
+                return static_cast<unsigned>(n);
+        }
+        unsigned n = std::thread::hardware_concurrency();
+        return n ? n : 1U;
+    }();
+    return threads;
+}
+
+// Helper threads currently available to parallel_for (worker_threads() - 1 at rest).
+static std::atomic<int> &spare_threads() {
+    static std::atomic<int> spare{static_cast<int>(worker_threads()) - 1};
+    return spare;
+}
+
+static int reserve_threads(int want) {
+    auto &spare = spare_threads();
+    int avail = spare.load();
+    int take;
+    do {
+        take = std::min(want, avail);
+        if (take <= 0)
+            return 0;
+    } while (!spare.compare_exchange_weak(avail, avail - take));
+    return take;
+}
+
+void parallel_for(std::size_t count, const std::function<void(std::size_t)> &fn) {
+    if (count == 0)
+        return;
+    if (count == 1) {
+        fn(0);
+        return;
+    }
+
+    std::atomic<std::size_t> next{0};
+    std::exception_ptr error;
+    std::mutex error_lock;
+    auto run = [&] {
+        for (std::size_t i; (i = next.fetch_add(1)) < count;) {
+            try {
+                fn(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_lock);
+                if (!error)
+                    error = std::current_exception();
+                next = count;
+            }
+        }
+    };
+
+    int helpers = reserve_threads(static_cast<int>(std::min<std::size_t>(count - 1, worker_threads())));
+    std::vector<std::thread> pool;
+    pool.reserve(helpers);
+    try {
+        for (int i = 0; i < helpers; ++i)
+            pool.emplace_back(run);
+    } catch (const std::system_error &) {
+        // Out of threads: whatever started (plus this thread) finishes the work.
+    }
+    run();
+    for (auto &t : pool)
+        t.join();
+    spare_threads() += helpers;
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
 mmap_data::mmap_data(const char *name, bool rw) {
     int flags = rw ? O_RDWR : O_RDONLY;
     int fd = ::open(name, flags);
@@ -5,6 +5,7 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <climits>
 #include <cstring>
 #include <string>
 #include <string_view>
@@ -15,8 +16,12 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #if defined(__linux__)
+#include <sys/ioctl.h>
 #include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
 #endif
 #include <fcntl.h>
 #include <unistd.h>
@@ -121,6 +126,89 @@ inline ssize_t xsendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
 #endif
 }
 
+// xcopy_range: copy count bytes at in_off of in_fd to the current position of out_fd.
+// Where both files sit on the same btrfs/XFS volume and the offsets are equally block
+// aligned, the aligned blocks are cloned with FICLONERANGE and share extents with the
+// source. Otherwise copy_file_range copies in-kernel, falling back to sendfile /
+// read+write. Returns the bytes copied.
+inline size_t xcopy_range(int out_fd, int in_fd, off_t in_off, size_t count) {
+    size_t done = 0;
+#if defined(__linux__) && defined(FICLONERANGE)
+    struct stat st{};
+    off_t out_off = ::lseek(out_fd, 0, SEEK_CUR);
+    if (out_off >= 0 && ::fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_blksize > 0 &&
+        in_off % st.st_blksize == out_off % st.st_blksize) {
+        const off_t blk = st.st_blksize;
+        const size_t head = static_cast<size_t>((blk - out_off % blk) % blk);
+        const size_t body = count > head ? (count - head) / blk * blk : 0;
+        if (body && (done = xcopy_range(out_fd, in_fd, in_off, head)) == head) {
+            struct file_clone_range range{};
+            range.src_fd = in_fd;
+            range.src_offset = static_cast<__u64>(in_off) + head;
+            range.src_length = body;
+            range.dest_offset = static_cast<__u64>(out_off) + head;
+            if (::ioctl(out_fd, FICLONERANGE, &range) == 0 &&
+                ::lseek(out_fd, static_cast<off_t>(range.dest_offset + body), SEEK_SET) >= 0)
+                done += body;
+        }
+    }
+#endif
+#if defined(__linux__) && defined(__NR_copy_file_range)
+    while (done < count) {
+        loff_t off = in_off + static_cast<off_t>(done);
+        long n = ::syscall(__NR_copy_file_range, in_fd, &off, out_fd, nullptr, count - done, 0u);
+        if (n <= 0) break;
+        done += static_cast<size_t>(n);
+    }
+#endif
+    while (done < count) {
+        off_t off = in_off + static_cast<off_t>(done);
+        ssize_t n = xsendfile(out_fd, in_fd, &off, count - done);
+        if (n <= 0) break;
+        done += static_cast<size_t>(n);
+    }
+    return done;
+}
+
+// xwritev_all: write every buffer of iov[0, count) to fd with writev, IOV_MAX at a time,
+// resuming after short writes. iov is consumed. Returns false on error.
+inline bool xwritev_all(int fd, struct iovec *iov, size_t count) {
+    struct iovec *end = iov + count;
+    while (iov != end) {
+        int n_iov = static_cast<int>(end - iov < IOV_MAX ? end - iov : IOV_MAX);
+        ssize_t n = ::writev(fd, iov, n_iov);
+        if (n < 0) {
+            PLOGE("writev");
+            return false;
+        }
+        for (; iov != end && static_cast<size_t>(n) >= iov->iov_len; ++iov)
+            n -= static_cast<ssize_t>(iov->iov_len);
+        if (n > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+            iov->iov_len -= static_cast<size_t>(n);
+        }
+    }
+    return true;
+}
+
+// xmemfd: anonymous read/write file for scratch output. Uses memfd_create on Linux and
+// falls back to an unlinked file under $TMPDIR (or /tmp).
+inline int xmemfd(const char *name) {
+#if defined(__linux__) && defined(__NR_memfd_create)
+    if (int fd = static_cast<int>(::syscall(__NR_memfd_create, name, 1u /* MFD_CLOEXEC */)); fd >= 0)
+        return fd;
+#endif
+    const char *dir = getenv("TMPDIR");
+    std::string path = std::string(dir && *dir ? dir : "/tmp") + "/" + name + "-XXXXXX";
+    int fd = ::mkstemp(path.data());
+    if (fd < 0) {
+        PLOGE("mkstemp %s", path.c_str());
+        return -1;
+    }
+    ::unlink(path.c_str());
+    return fd;
+}
+
 inline int xmkdir(const char *pathname, mode_t mode) {
     int r = ::mkdir(pathname, mode);
     if (r < 0 && errno != EEXIST) PLOGE("mkdir %s", pathname ? pathname : "(null)");
@@ -153,10 +241,10 @@ inline int xmkdirs(const char *pathname, mode_t mode) {
 
 // write_zero: write `size` zero bytes to fd
 inline void write_zero(int fd, std::size_t size) {
-    std::vector<char> buf(65536, 0);
+    static const char buf[65536] = {};
     while (size > 0) {
-        std::size_t n = size < buf.size() ? size : buf.size();
-        if (xwrite(fd, buf.data(), n) != static_cast<ssize_t>(n))
+        std::size_t n = size < sizeof(buf) ? size : sizeof(buf);
+        if (xwrite(fd, buf, n) != static_cast<ssize_t>(n))
             return;
         size -= n;
     }
@@ -207,6 +295,16 @@ inline void parse_prop_file(const char *file, Functor &&fn) {
 // rm_rf: recursively remove path
 bool rm_rf(const char *path);
 
+// worker_threads: number of threads the parallel codecs may use. Defaults to the
+// number of CPUs; override with the MAGISKBOOT_THREADS environment variable.
+unsigned worker_threads();
+
+// parallel_for: run fn(0) .. fn(count - 1) across up to worker_threads() threads.
+// The calling thread takes part, and helper threads are drawn from a process-wide
+// budget so nested calls never run more than worker_threads() threads in total.
+// The first exception thrown by fn is rethrown once every index has finished.
+void parallel_for(std::size_t count, const std::function<void(std::size_t)> &fn);
+
 template <typename T>
 static inline T align_to(T v, int a) {
     static_assert(std::is_integral_v<T>);
@@ -260,6 +358,16 @@ private:
 struct owned_fd {
     owned_fd() : fd(-1) {}
     explicit owned_fd(int fd) : fd(fd) {}
+    owned_fd(owned_fd &&o) noexcept : fd(o.release()) {}
+    owned_fd &operator=(owned_fd &&o) noexcept {
+        if (this != &o) {
+            if (fd >= 0) ::close(fd);
+            fd = o.release();
+        }
+        return *this;
+    }
+    owned_fd(const owned_fd &) = delete;
+    owned_fd &operator=(const owned_fd &) = delete;
     ~owned_fd() { if (fd >= 0) ::close(fd); }
 
     operator int() const { return fd; }
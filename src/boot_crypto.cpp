@@ -1,5 +1,6 @@
 #include <algorithm>
 #include <array>
+#include <cctype>
 #include <cstdint>
 #include <cstring>
 #include <stdexcept>
@@ -7,20 +8,44 @@
 #include <zlib.h>
 #include <lz4.h>
 #include <lz4frame.h>
+#include <lz4hc.h>
+#include <xxhash.h>
+#ifdef USE_LZMA
+#include <lzma.h>
+#endif
+#ifdef USE_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 #ifdef USE_OPENSSL_SHA
+#include <openssl/evp.h>
 #include <openssl/sha.h>
 #endif
 
 #include "base_host.hpp"
 #include "boot_crypto.hpp"
+#include "sha.hpp"
 
 // ===========================
-// SHA‑1 / SHA‑256 via external lib (OpenSSL if enabled)
+// SHA‑1 / SHA‑256 / SHA-512 via OpenSSL if enabled, else the built-in implementation
 // ===========================
 
 SHA::SHA(Algorithm algo) : alg_(algo), ctx_(nullptr) {
 #ifdef USE_OPENSSL_SHA
-    if (alg_ == Algorithm::SHA256) {
+    if (alg_ == Algorithm::SHA512) {
+        // SHA-512 goes through EVP: its SHA512_* calls are deprecated in OpenSSL 3
+        EVP_MD_CTX *c = EVP_MD_CTX_new();
+        if (c && EVP_DigestInit_ex(c, EVP_sha512(), nullptr) != 1) {
+            EVP_MD_CTX_free(c);
+            c = nullptr;
+        }
+        ctx_ = c;
+    } else if (alg_ == Algorithm::SHA256) {
         auto *c = new SHA256_CTX;
         SHA256_Init(c);
         ctx_ = c;
@@ -30,16 +55,24 @@ SHA::SHA(Algorithm algo) : alg_(algo), ctx_(nullptr) {
         ctx_ = c;
     }
 #else
-    (void)alg_;
-    LOGE("SHA context not backed by any external implementation\n");
-    std::abort();
+    if (alg_ == Algorithm::SHA512) {
+        auto *c = new sha512_ctx;
+        sha512_init(*c);
+        ctx_ = c;
+    } else {
+        auto *c = new sha_ctx;
+        sha_init(*c, alg_ == Algorithm::SHA256);
+        ctx_ = c;
+    }
 #endif
 }
 
 void SHA::update(byte_view data) {
-#ifdef USE_OPENSSL_SHA
     if (!ctx_) return;
-    if (alg_ == Algorithm::SHA256) {
+#ifdef USE_OPENSSL_SHA
+    if (alg_ == Algorithm::SHA512) {
+        EVP_DigestUpdate(static_cast<EVP_MD_CTX *>(ctx_), data.data(), data.size());
+    } else if (alg_ == Algorithm::SHA256) {
         auto *c = static_cast<SHA256_CTX *>(ctx_);
         SHA256_Update(c, data.data(), data.size());
     } else {
@@ -47,43 +80,53 @@ void SHA::update(byte_view data) {
         SHA1_Update(c, data.data(), data.size());
     }
 #else
-    (void)data;
+    if (alg_ == Algorithm::SHA512)
+        sha512_update(*static_cast<sha512_ctx *>(ctx_), data.data(), data.size());
+    else
+        sha_update(*static_cast<sha_ctx *>(ctx_), data.data(), data.size());
 #endif
 }
 
 void SHA::finalize_into(byte_data out) {
-#ifdef USE_OPENSSL_SHA
     if (!ctx_) return;
-    if (alg_ == Algorithm::SHA256) {
-        if (out.size() < SHA256_DIGEST_LENGTH) {
-            LOGE("SHA256 output buffer too small\n");
-            std::abort();
-        }
+    if (out.size() < output_size()) {
+        LOGE("SHA output buffer too small\n");
+        std::abort();
+    }
+#ifdef USE_OPENSSL_SHA
+    if (alg_ == Algorithm::SHA512) {
+        auto *c = static_cast<EVP_MD_CTX *>(ctx_);
+        EVP_DigestFinal_ex(c, out.data(), nullptr);
+        EVP_MD_CTX_free(c);
+    } else if (alg_ == Algorithm::SHA256) {
         auto *c = static_cast<SHA256_CTX *>(ctx_);
         SHA256_Final(out.data(), c);
         delete c;
     } else {
-        if (out.size() < SHA_DIGEST_LENGTH) {
-            LOGE("SHA1 output buffer too small\n");
-            std::abort();
-        }
         auto *c = static_cast<SHA_CTX *>(ctx_);
         SHA1_Final(out.data(), c);
         delete c;
     }
-    ctx_ = nullptr;
 #else
-    (void)out;
+    if (alg_ == Algorithm::SHA512) {
+        auto *c = static_cast<sha512_ctx *>(ctx_);
+        sha512_final(*c, out.data());
+        delete c;
+    } else {
+        auto *c = static_cast<sha_ctx *>(ctx_);
+        sha_final(*c, out.data());
+        delete c;
+    }
 #endif
+    ctx_ = nullptr;
 }
 
 std::size_t SHA::output_size() const {
-#ifdef USE_OPENSSL_SHA
-    return alg_ == Algorithm::SHA256 ? static_cast<std::size_t>(SHA256_DIGEST_LENGTH)
-                                     : static_cast<std::size_t>(SHA_DIGEST_LENGTH);
-#else
-    return 0;
-#endif
+    switch (alg_) {
+    case Algorithm::SHA1: return 20;
+    case Algorithm::SHA256: return 32;
+    default: return 64;
+    }
 }
 
 std::unique_ptr<SHA> get_sha(bool use_sha1) {
@@ -121,10 +164,192 @@ std::uint32_t read_le32(const std::uint8_t *p) {
            (static_cast<std::uint32_t>(p[3]) << 24);
 }
 
+void write_all(int out_fd, const void *buf, std::size_t len) {
+    if (xwrite(out_fd, buf, len) != static_cast<ssize_t>(len)) {
+        throw std::runtime_error("write failed");
+    }
+}
+
+void write_all_at(int out_fd, const void *buf, std::size_t len, off_t off) {
+    const auto *p = static_cast<const char *>(buf);
+    while (len > 0) {
+        ssize_t n = pwrite(out_fd, p, len, off);
+        if (n <= 0) {
+            PLOGE("pwrite");
+            throw std::runtime_error("write failed");
+        }
+        p += n;
+        len -= static_cast<std::size_t>(n);
+        off += n;
+    }
+}
+
+// Encode `count` independent blocks on the worker pool and write them to out_fd in
+// block order. encode(i, out) replaces `out` with the bytes of block i. Blocks are
+// handled in batches so only a bounded window of output is held in memory.
+template <typename Encode>
+void write_ordered_blocks(std::size_t count, int out_fd, Encode &&encode) {
+    const std::size_t batch = std::min<std::size_t>(count, std::size_t{worker_threads()} * 16);
+    std::vector<std::vector<char>> bufs(batch);
+    for (std::size_t base = 0; base < count; base += batch) {
+        const std::size_t n = std::min(batch, count - base);
+        parallel_for(n, [&](std::size_t i) { encode(base + i, bufs[i]); });
+        for (std::size_t i = 0; i < n; ++i) {
+            write_all(out_fd, bufs[i].data(), bufs[i].size());
+        }
+    }
+}
+
+// Decode `count` blocks whose output sizes are known up front. Blocks are decoded
+// concurrently and written straight to their final offsets; when out_fd cannot seek
+// (a pipe) they go through write_ordered_blocks instead. decode(i, out) must fill
+// exactly size(i) bytes at `out`.
+template <typename Size, typename Decode>
+void write_sized_blocks(std::size_t count, int out_fd, Size &&size, Decode &&decode) {
+    const off_t base = lseek(out_fd, 0, SEEK_CUR);
+    if (base < 0) {
+        write_ordered_blocks(count, out_fd, [&](std::size_t i, std::vector<char> &out) {
+            out.resize(size(i));
+            decode(i, out.data());
+        });
+        return;
+    }
+    std::vector<off_t> offs(count + 1);
+    offs[0] = base;
+    for (std::size_t i = 0; i < count; ++i) {
+        offs[i + 1] = offs[i] + static_cast<off_t>(size(i));
+    }
+    parallel_for(count, [&](std::size_t i) {
+        thread_local std::vector<char> out;
+        out.resize(size(i));
+        decode(i, out.data());
+        write_all_at(out_fd, out.data(), out.size(), offs[i]);
+    });
+    lseek(out_fd, offs[count], SEEK_SET);
+}
+
+// Parse a byte count such as "65536", "256K" or "4M"; returns `def` when unset or invalid.
+std::size_t env_size(const char *name, std::size_t def) {
+    const char *env = getenv(name);
+    if (env == nullptr || *env == '\0')
+        return def;
+    char *end = nullptr;
+    unsigned long long v = std::strtoull(env, &end, 10);
+    if (end != env && (*end == 'k' || *end == 'K')) {
+        v <<= 10;
+        ++end;
+    } else if (end != env && (*end == 'm' || *end == 'M')) {
+        v <<= 20;
+        ++end;
+    }
+    if (end == env || *end != '\0' || v == 0) {
+        LOGW("magiskboot: ignoring invalid %s=%s\n", name, env);
+        return def;
+    }
+    return static_cast<std::size_t>(v);
+}
+
+// LZ4 tunables for repacking, read once from the environment:
+//   MAGISKBOOT_LZ4_LEVEL         compression level; LZ4HC_CLEVEL_MIN..12 selects LZ4 HC
+//   MAGISKBOOT_LZ4_BLOCK         LZ4 frame block size: 64K (default), 256K, 1M or 4M
+//   MAGISKBOOT_LZ4_LEGACY_BLOCK  LZ4 legacy chunk size, up to 8M (default 64K)
+struct lz4_options {
+    int level = 0;
+    LZ4F_blockSizeID_t frame_block = LZ4F_default;
+    std::size_t legacy_block = LZ4_LEGACY_COMPRESS_BLOCK;
+
+    bool hc() const { return level >= LZ4HC_CLEVEL_MIN; }
+};
+
+const lz4_options &lz4_opts() {
+    static const lz4_options opts = [] {
+        lz4_options o;
+        if (const char *env = getenv("MAGISKBOOT_LZ4_LEVEL")) {
+            o.level = std::clamp(std::atoi(env), 0, LZ4HC_CLEVEL_MAX);
+        }
+        switch (env_size("MAGISKBOOT_LZ4_BLOCK", 0)) {
+            case 0:
+            case 64 * 1024:        o.frame_block = LZ4F_default; break;
+            case 256 * 1024:       o.frame_block = LZ4F_max256KB; break;
+            case 1024 * 1024:      o.frame_block = LZ4F_max1MB; break;
+            case 4 * 1024 * 1024:  o.frame_block = LZ4F_max4MB; break;
+            default:
+                LOGW("magiskboot: MAGISKBOOT_LZ4_BLOCK must be 64K, 256K, 1M or 4M\n");
+                break;
+        }
+        o.legacy_block = std::min(env_size("MAGISKBOOT_LZ4_LEGACY_BLOCK", LZ4_LEGACY_COMPRESS_BLOCK),
+                                  LZ4_LEGACY_BLOCK_MAX);
+        return o;
+    }();
+    return opts;
+}
+
+std::size_t lz4f_block_bytes(LZ4F_blockSizeID_t id) {
+    switch (id) {
+        case LZ4F_max256KB: return 256 * 1024;
+        case LZ4F_max1MB:   return 1024 * 1024;
+        case LZ4F_max4MB:   return 4 * 1024 * 1024;
+        default:            return 64 * 1024;
+    }
+}
+
+// Compress one block into out[prefix..], with LZ4 HC when a HC level is configured.
+// Returns the compressed size, or 0 when the block does not fit in `cap` bytes.
+int lz4_compress_block(const char *src, int len, std::vector<char> &out, std::size_t prefix, int cap) {
+    out.resize(prefix + static_cast<std::size_t>(std::max(cap, 0)));
+    const auto &opts = lz4_opts();
+    if (opts.hc()) {
+        return LZ4_compress_HC(src, out.data() + prefix, len, cap, opts.level);
+    }
+    return LZ4_compress_default(src, out.data() + prefix, len, cap);
+}
+
+// LZ4 frame with independent blocks, each compressed on the worker pool. Used for
+// the HC levels, where LZ4F_compressFrame would run the slow matcher on one core.
+void lz4f_compress_parallel(byte_view in, int out_fd) {
+    const auto &opts = lz4_opts();
+    const std::size_t block = lz4f_block_bytes(opts.frame_block);
+    const std::size_t count = (in.size() + block - 1) / block;
+
+    unsigned char header[7] = {0x04, 0x22, 0x4d, 0x18};
+    header[4] = 0x40 | 0x20;  /* version 01, independent blocks */
+    header[5] = static_cast<unsigned char>((opts.frame_block == LZ4F_default ? LZ4F_max64KB
+                                                                             : opts.frame_block) << 4);
+    header[6] = static_cast<unsigned char>((XXH32(header + 4, 2, 0) >> 8) & 0xff);
+    write_all(out_fd, header, sizeof(header));
+
+    write_ordered_blocks(count, out_fd, [&](std::size_t i, std::vector<char> &out) {
+        const std::size_t off = i * block;
+        const int len = static_cast<int>(std::min(block, in.size() - off));
+        const char *src = reinterpret_cast<const char *>(in.data()) + off;
+        std::uint32_t sz = static_cast<std::uint32_t>(lz4_compress_block(src, len, out, 4, len - 1));
+        if (sz == 0) {
+            // Incompressible: store the block raw, flagged by the high bit of its size.
+            out.resize(4 + static_cast<std::size_t>(len));
+            std::memcpy(out.data() + 4, src, static_cast<std::size_t>(len));
+            sz = static_cast<std::uint32_t>(len) | 0x80000000U;
+        } else {
+            out.resize(4 + sz);
+        }
+        std::memcpy(out.data(), &sz, 4);
+    });
+
+    const std::uint32_t end_mark = 0;
+    write_all(out_fd, &end_mark, sizeof(end_mark));
+}
+
 void lz4f_compress(byte_view in, int out_fd) {
-    std::size_t bound = LZ4F_compressFrameBound(in.size(), nullptr);
+    const auto &opts = lz4_opts();
+    if (opts.hc()) {
+        lz4f_compress_parallel(in, out_fd);
+        return;
+    }
+    LZ4F_preferences_t prefs{};
+    prefs.frameInfo.blockSizeID = opts.frame_block;
+    prefs.compressionLevel = opts.level;
+    std::size_t bound = LZ4F_compressFrameBound(in.size(), &prefs);
     std::vector<char> buf(bound);
-    std::size_t n = LZ4F_compressFrame(buf.data(), bound, in.data(), in.size(), nullptr);
+    std::size_t n = LZ4F_compressFrame(buf.data(), bound, in.data(), in.size(), &prefs);
     if (LZ4F_isError(n)) {
         LOGE("LZ4F_compressFrame failed: %s\n", LZ4F_getErrorName(n));
         throw std::runtime_error("LZ4 frame compress failed");
@@ -163,23 +388,22 @@ void lz4f_decompress(byte_view in, int out_fd) {
 }
 
 void lz4_legacy_compress(byte_view in, int out_fd) {
-    xwrite(out_fd, LZ4_LEGACY_MAGIC, LZ4_LEGACY_MAGIC_SIZE);
-    std::vector<char> c_buf(static_cast<std::size_t>(
-        LZ4_compressBound(static_cast<int>(LZ4_LEGACY_COMPRESS_BLOCK))));
-    const char *src = reinterpret_cast<const char *>(in.data());
-    std::size_t remaining = in.size();
-    while (remaining > 0) {
-        int chunk = static_cast<int>(std::min<std::size_t>(remaining, LZ4_LEGACY_COMPRESS_BLOCK));
-        int c_sz = LZ4_compress_default(src, c_buf.data(), chunk, static_cast<int>(c_buf.size()));
+    write_all(out_fd, LZ4_LEGACY_MAGIC, LZ4_LEGACY_MAGIC_SIZE);
+    const std::size_t block = lz4_opts().legacy_block;
+    const std::size_t chunks = (in.size() + block - 1) / block;
+    const int bound = LZ4_compressBound(static_cast<int>(block));
+    write_ordered_blocks(chunks, out_fd, [&](std::size_t i, std::vector<char> &out) {
+        const std::size_t off = i * block;
+        const int chunk = static_cast<int>(std::min(in.size() - off, block));
+        int c_sz = lz4_compress_block(reinterpret_cast<const char *>(in.data()) + off,
+                                      chunk, out, 4, bound);
         if (c_sz <= 0) {
             throw std::runtime_error("LZ4 legacy compress failed");
         }
         std::uint32_t le = static_cast<std::uint32_t>(c_sz);
-        xwrite(out_fd, &le, 4);
-        xwrite(out_fd, c_buf.data(), c_sz);
-        src += chunk;
-        remaining -= static_cast<std::size_t>(chunk);
-    }
+        std::memcpy(out.data(), &le, 4);
+        out.resize(4 + static_cast<std::size_t>(c_sz));
+    });
 }
 
 // LZ4 legacy (block format: magic + [4-byte comp_sz LE][block]...) — match Magisk native
@@ -188,6 +412,63 @@ constexpr std::size_t LZ4_LEGACY_COMP_BLOCK_MAX = 16 * 1024 * 1024;  // 16MB max
 // Cap total decompressed size to avoid corrupt/malicious stream filling disk (e.g. many small blocks).
 constexpr std::size_t LZ4_LEGACY_DECOMP_TOTAL_MAX = 256 * 1024 * 1024;  // 256MB
 
+struct lz4_legacy_block {
+    std::size_t in_off;
+    std::uint32_t comp_sz;
+    std::uint32_t out_sz;
+};
+
+// Decoded size of one raw LZ4 block, found by walking its sequence tokens without
+// copying any literals or matches. Returns -1 for a malformed block or one that
+// would not fit in LZ4_LEGACY_BLOCK_MAX.
+std::int64_t lz4_block_decoded_size(const std::uint8_t *ip, std::size_t len) {
+    const std::uint8_t *const end = ip + len;
+    auto read_len = [&](std::size_t &n) -> bool {
+        std::uint8_t b;
+        do {
+            if (ip >= end)
+                return false;
+            b = *ip++;
+            n += b;
+        } while (b == 255);
+        return true;
+    };
+    std::size_t out = 0;
+    while (ip < end) {
+        const unsigned token = *ip++;
+        std::size_t lit = token >> 4;
+        if (lit == 15 && !read_len(lit))
+            return -1;
+        if (lit > static_cast<std::size_t>(end - ip))
+            return -1;
+        ip += lit;
+        out += lit;
+        if (ip == end)
+            break;
+        if (end - ip < 2)
+            return -1;
+        ip += 2;
+        std::size_t match = token & 15;
+        if (match == 15 && !read_len(match))
+            return -1;
+        out += match + 4;
+        if (out > LZ4_LEGACY_BLOCK_MAX)
+            return -1;
+    }
+    return out > LZ4_LEGACY_BLOCK_MAX ? -1 : static_cast<std::int64_t>(out);
+}
+
+void lz4_legacy_decode_block(byte_view in, const lz4_legacy_block &b, char *out) {
+    int n = LZ4_decompress_safe(reinterpret_cast<const char *>(in.data()) + b.in_off, out,
+                                static_cast<int>(b.comp_sz), static_cast<int>(b.out_sz));
+    if (n < 0 || static_cast<std::uint32_t>(n) != b.out_sz) {
+        LOGE("magiskboot: LZ4_decompress_safe failed: %d\n", n);
+        throw std::runtime_error("LZ4 legacy decompress failed");
+    }
+}
+
+// Two passes: first index every block and size its output from the token stream,
+// then decode all blocks concurrently straight to their final file offsets.
 void lz4_legacy_decompress(byte_view in, int out_fd) {
     if (in.size() <= LZ4_LEGACY_MAGIC_SIZE + 4) {
         LOGE("magiskboot: LZ4 legacy stream too short\n");
@@ -197,9 +478,9 @@ void lz4_legacy_decompress(byte_view in, int out_fd) {
         LOGE("magiskboot: LZ4 legacy bad magic\n");
         throw std::runtime_error("LZ4 legacy bad magic");
     }
-    std::vector<char> out_buf(LZ4_LEGACY_BLOCK_MAX);
+
+    std::vector<lz4_legacy_block> blocks;
     std::size_t off = LZ4_LEGACY_MAGIC_SIZE;
-    std::size_t total_out = 0;
     while (off + 4 <= in.size()) {
         std::uint32_t comp_sz;
         std::memcpy(&comp_sz, in.data() + off, 4);
@@ -215,26 +496,36 @@ void lz4_legacy_decompress(byte_view in, int out_fd) {
             LOGE("magiskboot: LZ4 legacy block too large: %u\n", comp_sz);
             throw std::runtime_error("LZ4 legacy block too large");
         }
-        int n = LZ4_decompress_safe(reinterpret_cast<const char *>(in.data()) + off,
-                                    out_buf.data(), static_cast<int>(comp_sz),
-                                    static_cast<int>(out_buf.size()));
+        blocks.push_back({off, comp_sz, 0});
+        off += comp_sz;
+    }
+
+    parallel_for(blocks.size(), [&](std::size_t i) {
+        auto &b = blocks[i];
+        std::int64_t n = lz4_block_decoded_size(in.data() + b.in_off, b.comp_sz);
         if (n < 0) {
-            LOGE("magiskboot: LZ4_decompress_safe failed: %d\n", n);
+            LOGE("magiskboot: LZ4 legacy block %zu is corrupted\n", i);
             throw std::runtime_error("LZ4 legacy decompress failed");
         }
-        const std::size_t n_u = static_cast<std::size_t>(n);
-        if (total_out + n_u > LZ4_LEGACY_DECOMP_TOTAL_MAX) {
+        b.out_sz = static_cast<std::uint32_t>(n);
+    });
+
+    std::size_t total_out = 0;
+    for (const auto &b : blocks) {
+        if (total_out + b.out_sz > LZ4_LEGACY_DECOMP_TOTAL_MAX) {
             LOGE("magiskboot: LZ4 legacy total decompressed size exceeds %zu\n",
                  LZ4_LEGACY_DECOMP_TOTAL_MAX);
             throw std::runtime_error("LZ4 legacy decompress output too large");
         }
-        total_out += n_u;
-        xwrite(out_fd, out_buf.data(), n_u);
-        off += comp_sz;
+        total_out += b.out_sz;
     }
+
+    write_sized_blocks(
+            blocks.size(), out_fd, [&](std::size_t i) { return blocks[i].out_sz; },
+            [&](std::size_t i, char *out) { lz4_legacy_decode_block(in, blocks[i], out); });
 }
 
-void zlib_deflate_gzip(byte_view in, int out_fd, int level) {
+void zlib_deflate_gzip_serial(byte_view in, int out_fd, int level) {
     z_stream strm{};
     if (deflateInit2(&strm, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
         LOGE("deflateInit2 failed\n");
@@ -262,7 +553,145 @@ void zlib_deflate_gzip(byte_view in, int out_fd, int level) {
     deflateEnd(&strm);
 }
 
+// pigz-style gzip: the input is cut into blocks that are deflated concurrently as
+// raw deflate streams, each primed with the 32 KiB of input before it so matches
+// can still reach back across the cut. Every block but the last ends with a sync
+// flush, so their concatenation forms one deflate stream inside a single gzip
+// member whose CRC32 is combined from the per-block CRCs.
+constexpr std::size_t GZIP_PARALLEL_BLOCK = 128 * 1024;
+constexpr std::size_t GZIP_DICT_SIZE = 32 * 1024;
+
+void zlib_deflate_gzip_parallel(byte_view in, int out_fd, int level) {
+    const std::size_t blocks = (in.size() + GZIP_PARALLEL_BLOCK - 1) / GZIP_PARALLEL_BLOCK;
+    std::vector<uLong> crcs(blocks);
+
+    // Same header zlib writes: no name, mtime 0, XFL from the level, OS = Unix.
+    const unsigned char header[10] = {
+        0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0,
+        static_cast<unsigned char>(level == Z_BEST_COMPRESSION ? 2 : level == Z_BEST_SPEED ? 4 : 0),
+        3,
+    };
+    write_all(out_fd, header, sizeof(header));
+
+    write_ordered_blocks(blocks, out_fd, [&](std::size_t i, std::vector<char> &out) {
+        const std::size_t off = i * GZIP_PARALLEL_BLOCK;
+        const std::size_t len = std::min(GZIP_PARALLEL_BLOCK, in.size() - off);
+        const bool last = i + 1 == blocks;
+        const auto *src = reinterpret_cast<const Bytef *>(in.data());
+
+        z_stream strm{};
+        if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            LOGE("deflateInit2 failed\n");
+            throw std::runtime_error("deflateInit2 failed");
+        }
+        if (off > 0) {
+            const std::size_t dict = std::min(off, GZIP_DICT_SIZE);
+            deflateSetDictionary(&strm, src + off - dict, static_cast<uInt>(dict));
+        }
+        out.resize(deflateBound(&strm, static_cast<uLong>(len)) + 16);
+        strm.next_in = const_cast<Bytef *>(src + off);
+        strm.avail_in = static_cast<uInt>(len);
+        int ret;
+        for (;;) {
+            strm.next_out = reinterpret_cast<Bytef *>(out.data()) + strm.total_out;
+            strm.avail_out = static_cast<uInt>(out.size() - strm.total_out);
+            ret = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+            if (ret == Z_STREAM_ERROR)
+                break;
+            if ((last && ret == Z_STREAM_END) || (!last && strm.avail_in == 0 && strm.avail_out != 0))
+                break;
+            out.resize(out.size() * 2);
+        }
+        out.resize(strm.total_out);
+        deflateEnd(&strm);
+        if (ret == Z_STREAM_ERROR) {
+            LOGE("deflate stream error\n");
+            throw std::runtime_error("deflate stream error");
+        }
+        crcs[i] = crc32(0L, src + off, static_cast<uInt>(len));
+    });
+
+    uLong crc = crc32(0L, Z_NULL, 0);
+    for (std::size_t i = 0; i < blocks; ++i) {
+        const std::size_t len = std::min(GZIP_PARALLEL_BLOCK, in.size() - i * GZIP_PARALLEL_BLOCK);
+        crc = crc32_combine(crc, crcs[i], static_cast<z_off_t>(len));
+    }
+    unsigned char trailer[8];
+    const auto isize = static_cast<std::uint32_t>(in.size());
+    for (int i = 0; i < 4; ++i) {
+        trailer[i] = static_cast<unsigned char>(crc >> (8 * i));
+        trailer[4 + i] = static_cast<unsigned char>(isize >> (8 * i));
+    }
+    write_all(out_fd, trailer, sizeof(trailer));
+}
+
+#ifdef USE_LIBDEFLATE
+// ===========================
+// gzip via libdeflate (whole buffer)
+// ===========================
+
+// Compress the whole input in one call. ZOPFLI asks for libdeflate's strongest level.
+void libdeflate_gzip_compress_buf(byte_view in, int out_fd, int level) {
+    std::unique_ptr<libdeflate_compressor, decltype(&libdeflate_free_compressor)> c(
+            libdeflate_alloc_compressor(level == Z_BEST_COMPRESSION ? 12 : 6), &libdeflate_free_compressor);
+    if (!c) {
+        throw std::runtime_error("libdeflate_alloc_compressor failed");
+    }
+    const std::size_t bound = libdeflate_gzip_compress_bound(c.get(), in.size());
+    std::unique_ptr<char[]> out(new char[bound]);
+    const std::size_t n = libdeflate_gzip_compress(c.get(), in.data(), in.size(), out.get(), bound);
+    if (n == 0) {
+        LOGE("libdeflate_gzip_compress failed\n");
+        throw std::runtime_error("libdeflate compress failed");
+    }
+    write_all(out_fd, out.get(), n);
+}
+
+// Inflate a single-member stream in one call, sizing the output from the ISIZE
+// trailer. Returns false without writing anything when that does not work out
+// (multiple members, trailing data, or an implausible size) so zlib can stream it.
+bool libdeflate_gzip_inflate(byte_view in, int out_fd) {
+    if (in.size() < 18)
+        return false;
+    const std::size_t isize = read_le32(in.data() + in.size() - 4);
+    if (isize > LZ4_LEGACY_DECOMP_TOTAL_MAX || isize / 1032 > in.size())
+        return false;
+    std::unique_ptr<libdeflate_decompressor, decltype(&libdeflate_free_decompressor)> d(
+            libdeflate_alloc_decompressor(), &libdeflate_free_decompressor);
+    if (!d) {
+        throw std::runtime_error("libdeflate_alloc_decompressor failed");
+    }
+    std::unique_ptr<char[]> out(new char[std::max<std::size_t>(isize, 1)]);
+    std::size_t in_used = 0;
+    std::size_t out_size = 0;
+    const libdeflate_result ret = libdeflate_gzip_decompress_ex(d.get(), in.data(), in.size(), out.get(), isize,
+                                                                &in_used, &out_size);
+    if (ret != LIBDEFLATE_SUCCESS || in_used != in.size() || out_size != isize)
+        return false;
+    write_all(out_fd, out.get(), out_size);
+    return true;
+}
+#endif // USE_LIBDEFLATE
+
+// With a single worker (MAGISKBOOT_THREADS=1) or a small input, emit a plain single
+// stream: libdeflate's when built with it, otherwise the exact output zlib always produced.
+void zlib_deflate_gzip(byte_view in, int out_fd, int level) {
+    if (worker_threads() > 1 && in.size() > GZIP_PARALLEL_BLOCK) {
+        zlib_deflate_gzip_parallel(in, out_fd, level);
+    } else {
+#ifdef USE_LIBDEFLATE
+        libdeflate_gzip_compress_buf(in, out_fd, level);
+#else
+        zlib_deflate_gzip_serial(in, out_fd, level);
+#endif
+    }
+}
+
 void zlib_inflate_gzip(byte_view in, int out_fd) {
+#ifdef USE_LIBDEFLATE
+    if (libdeflate_gzip_inflate(in, out_fd))
+        return;
+#endif
     z_stream strm{};
     if (inflateInit2(&strm, 15 + 32) != Z_OK) {
         LOGE("inflateInit2 failed\n");
@@ -290,6 +719,1004 @@ void zlib_inflate_gzip(byte_view in, int out_fd) {
     inflateEnd(&strm);
 }
 
+// ===========================
+// LZOP (LZO1X), native
+// ===========================
+
+constexpr unsigned char LZOP_FILE_MAGIC[] = {0x89, 'L', 'Z', 'O', 0x00, 0x0d, 0x0a, 0x1a, 0x0a};
+constexpr std::uint32_t LZOP_F_ADLER32_D = 0x00000001;
+constexpr std::uint32_t LZOP_F_ADLER32_C = 0x00000002;
+constexpr std::uint32_t LZOP_F_H_EXTRA_FIELD = 0x00000040;
+constexpr std::uint32_t LZOP_F_CRC32_D = 0x00000100;
+constexpr std::uint32_t LZOP_F_CRC32_C = 0x00000200;
+constexpr std::uint32_t LZOP_F_H_FILTER = 0x00000800;
+constexpr std::uint32_t LZOP_F_H_CRC32 = 0x00001000;
+constexpr std::uint32_t LZOP_F_OS_UNIX = 0x03000000;
+// lzop's default block size; the kernel's unlzo rejects anything larger.
+constexpr std::size_t LZOP_BLOCK_SIZE = 256 * 1024;
+constexpr std::size_t LZOP_BLOCK_MAX = 64 * 1024 * 1024;  // lzop's MAX_BLOCK_SIZE
+
+std::uint32_t read_be32(const std::uint8_t *p) {
+    return (static_cast<std::uint32_t>(p[0]) << 24) |
+           (static_cast<std::uint32_t>(p[1]) << 16) |
+           (static_cast<std::uint32_t>(p[2]) << 8) |
+           static_cast<std::uint32_t>(p[3]);
+}
+
+void put_be32(std::uint8_t *p, std::uint32_t v) {
+    p[0] = static_cast<std::uint8_t>(v >> 24);
+    p[1] = static_cast<std::uint8_t>(v >> 16);
+    p[2] = static_cast<std::uint8_t>(v >> 8);
+    p[3] = static_cast<std::uint8_t>(v);
+}
+
+// LZO1X decompressor with full input, output and look-behind checking, following
+// the reference lzo1x_decompress_safe. Returns false unless the block decodes to
+// exactly out_len bytes and ends on the end-of-stream marker.
+bool lzo1x_decompress(const std::uint8_t *in, std::size_t in_len, std::uint8_t *out, std::size_t out_len) {
+    const std::uint8_t *ip = in;
+    const std::uint8_t *const ip_end = in + in_len;
+    std::uint8_t *op = out;
+    std::uint8_t *const op_end = out + out_len;
+    const std::uint8_t *m_pos;
+    std::size_t t;
+
+#define NEED_IP(n) do { if (static_cast<std::size_t>(ip_end - ip) < (n)) return false; } while (0)
+#define NEED_OP(n) do { if (static_cast<std::size_t>(op_end - op) < (n)) return false; } while (0)
+#define TEST_LB(m) do { if ((m) < out || (m) >= op) return false; } while (0)
+#define READ_LEN(t, base) do {                      \
+        for (;;) {                                  \
+            NEED_IP(1);                             \
+            if (*ip != 0) break;                    \
+            (t) += 255;                             \
+            ++ip;                                   \
+        }                                           \
+        (t) += (base) + *ip++;                      \
+    } while (0)
+#define COPY_LITERALS(n) do {                       \
+        NEED_OP(n);                                 \
+        NEED_IP((n) + 1);                           \
+        std::memcpy(op, ip, (n));                   \
+        op += (n);                                  \
+        ip += (n);                                  \
+    } while (0)
+
+    NEED_IP(1);
+    if (*ip > 17) {
+        t = *ip++ - 17u;
+        if (t < 4)
+            goto match_next;
+        COPY_LITERALS(t);
+        goto first_literal_run;
+    }
+    for (;;) {
+        NEED_IP(3);
+        t = *ip++;
+        if (t >= 16)
+            goto match;
+        if (t == 0)
+            READ_LEN(t, 15u);
+        COPY_LITERALS(t + 3);
+    first_literal_run:
+        t = *ip++;
+        if (t >= 16)
+            goto match;
+        NEED_IP(1);
+        m_pos = op - (1 + 0x0800);
+        m_pos -= t >> 2;
+        m_pos -= static_cast<std::size_t>(*ip++) << 2;
+        TEST_LB(m_pos);
+        NEED_OP(3);
+        op[0] = m_pos[0];
+        op[1] = m_pos[1];
+        op[2] = m_pos[2];
+        op += 3;
+        goto match_done;
+
+        for (;;) {
+        match:
+            if (t >= 64) {
+                NEED_IP(1);
+                m_pos = op - 1;
+                m_pos -= (t >> 2) & 7;
+                m_pos -= static_cast<std::size_t>(*ip++) << 3;
+                t = (t >> 5) - 1;
+                TEST_LB(m_pos);
+                goto copy_match;
+            } else if (t >= 32) {
+                t &= 31;
+                if (t == 0)
+                    READ_LEN(t, 31u);
+                NEED_IP(2);
+                m_pos = op - 1;
+                m_pos -= (ip[0] >> 2) + (static_cast<std::size_t>(ip[1]) << 6);
+                ip += 2;
+            } else if (t >= 16) {
+                m_pos = op;
+                m_pos -= (t & 8) << 11;
+                t &= 7;
+                if (t == 0)
+                    READ_LEN(t, 7u);
+                NEED_IP(2);
+                m_pos -= (ip[0] >> 2) + (static_cast<std::size_t>(ip[1]) << 6);
+                ip += 2;
+                if (m_pos == op)
+                    goto eof_found;
+                m_pos -= 0x4000;
+            } else {
+                NEED_IP(1);
+                m_pos = op - 1;
+                m_pos -= t >> 2;
+                m_pos -= static_cast<std::size_t>(*ip++) << 2;
+                TEST_LB(m_pos);
+                NEED_OP(2);
+                op[0] = m_pos[0];
+                op[1] = m_pos[1];
+                op += 2;
+                goto match_done;
+            }
+            TEST_LB(m_pos);
+        copy_match:
+            NEED_OP(t + 2);
+            for (std::size_t i = 0; i < t + 2; ++i) {
+                op[i] = m_pos[i];  // may overlap the bytes being written
+            }
+            op += t + 2;
+        match_done:
+            t = ip[-2] & 3;
+            if (t == 0)
+                break;
+        match_next:
+            COPY_LITERALS(t);
+            t = *ip++;
+        }
+    }
+
+eof_found:
+    return t == 1 && ip == ip_end && op == op_end;
+#undef COPY_LITERALS
+#undef READ_LEN
+#undef TEST_LB
+#undef NEED_OP
+#undef NEED_IP
+}
+
+// Greedy single-probe LZO1X compressor in the spirit of LZO1X-1. Output is written to
+// `dst`, which must hold at least lzo1x_bound(len) bytes; returns the compressed size.
+std::size_t lzo1x_bound(std::size_t len) {
+    return len + len / 16 + 64 + 3;
+}
+
+std::size_t lzo1x_compress(const std::uint8_t *src, std::size_t len, std::uint8_t *dst) {
+    constexpr unsigned HASH_BITS = 14;
+    constexpr std::size_t MAX_OFFSET = 0xbfff;
+    thread_local std::vector<std::uint32_t> table;
+    table.assign(std::size_t{1} << HASH_BITS, 0);
+
+    std::uint8_t *op = dst;
+    std::uint8_t *state = nullptr;  /* byte whose low 2 bits count the following literals */
+
+    auto put_len = [&](std::size_t n) {
+        for (; n > 255; n -= 255) {
+            *op++ = 0;
+        }
+        *op++ = static_cast<std::uint8_t>(n);
+    };
+    auto put_literals = [&](const std::uint8_t *p, std::size_t n) {
+        if (n == 0)
+            return;
+        if (op == dst && n <= 238) {
+            *op++ = static_cast<std::uint8_t>(17 + n);
+        } else if (state != nullptr && n <= 3) {
+            *state |= static_cast<std::uint8_t>(n);
+        } else if (n - 3 <= 15) {
+            *op++ = static_cast<std::uint8_t>(n - 3);
+        } else {
+            *op++ = 0;
+            put_len(n - 18);
+        }
+        std::memcpy(op, p, n);
+        op += n;
+    };
+    auto put_match = [&](std::size_t dist, std::size_t n) {
+        if (n <= 8 && dist <= 0x0800) {
+            const std::size_t d = dist - 1;
+            *op++ = static_cast<std::uint8_t>(((n - 1) << 5) | ((d & 7) << 2));
+            state = op - 1;
+            *op++ = static_cast<std::uint8_t>(d >> 3);
+            return;
+        }
+        std::size_t d;
+        if (dist <= 0x4000) {
+            d = dist - 1;
+            if (n - 2 <= 31) {
+                *op++ = static_cast<std::uint8_t>(32 | (n - 2));
+            } else {
+                *op++ = 32;
+                put_len(n - 2 - 31);
+            }
+        } else {
+            d = dist - 0x4000;
+            const auto hi = static_cast<std::uint8_t>((d & 0x4000) >> 11);
+            d &= 0x3fff;
+            if (n - 2 <= 7) {
+                *op++ = static_cast<std::uint8_t>(16 | hi | (n - 2));
+            } else {
+                *op++ = static_cast<std::uint8_t>(16 | hi);
+                put_len(n - 2 - 7);
+            }
+        }
+        *op++ = static_cast<std::uint8_t>((d & 63) << 2);
+        state = op - 1;
+        *op++ = static_cast<std::uint8_t>(d >> 6);
+    };
+
+    std::size_t lit = 0;
+    std::size_t ip = 0;
+    while (len >= 4 && ip <= len - 4) {
+        std::uint32_t v;
+        std::memcpy(&v, src + ip, 4);
+        const std::uint32_t h = (v * 2654435761u) >> (32 - HASH_BITS);
+        const std::size_t cand = table[h];
+        table[h] = static_cast<std::uint32_t>(ip);
+        if (cand < ip && ip - cand <= MAX_OFFSET && std::memcmp(src + cand, src + ip, 3) == 0) {
+            std::size_t n = 3;
+            while (ip + n < len && src[cand + n] == src[ip + n]) {
+                ++n;
+            }
+            put_literals(src + lit, ip - lit);
+            put_match(ip - cand, n);
+            ip += n;
+            lit = ip;
+        } else {
+            ++ip;
+        }
+    }
+    put_literals(src + lit, len - lit);
+    *op++ = 16 | 1;  /* end-of-stream marker: M4 match with zero distance */
+    *op++ = 0;
+    *op++ = 0;
+    return static_cast<std::size_t>(op - dst);
+}
+
+// Blocks of LZOP_BLOCK_SIZE are compressed in parallel. Headers and checksums follow
+// lzop 1.03 defaults (Adler-32 of the uncompressed data only): the kernel's unlzo skips
+// exactly one checksum per block and does not look at the header flags.
+void lzop_compress(byte_view in, int out_fd) {
+    std::vector<std::uint8_t> hdr(LZOP_FILE_MAGIC, LZOP_FILE_MAGIC + sizeof(LZOP_FILE_MAGIC));
+    const std::size_t body = hdr.size();
+    hdr.resize(body + 25);
+    std::uint8_t *p = hdr.data() + body;
+    p[0] = 0x10; p[1] = 0x30;  /* version 1.03 */
+    p[2] = 0x20; p[3] = 0xa0;  /* LZO library 2.10 */
+    p[4] = 0x09; p[5] = 0x40;  /* version needed to extract */
+    p[6] = 1;                  /* M_LZO1X_1 */
+    p[7] = 5;                  /* level */
+    put_be32(p + 8, LZOP_F_ADLER32_D | LZOP_F_OS_UNIX);
+    put_be32(p + 12, 0100644); /* mode */
+    put_be32(p + 16, 0);       /* mtime low */
+    put_be32(p + 20, 0);       /* mtime high */
+    p[24] = 0;                 /* no file name */
+    std::uint8_t sum[4];
+    put_be32(sum, static_cast<std::uint32_t>(adler32(1, p, 25)));
+    hdr.insert(hdr.end(), sum, sum + 4);
+    write_all(out_fd, hdr.data(), hdr.size());
+
+    const std::size_t count = (in.size() + LZOP_BLOCK_SIZE - 1) / LZOP_BLOCK_SIZE;
+    write_ordered_blocks(count, out_fd, [&](std::size_t i, std::vector<char> &out) {
+        const std::size_t off = i * LZOP_BLOCK_SIZE;
+        const std::size_t len = std::min(LZOP_BLOCK_SIZE, in.size() - off);
+        const std::uint8_t *src = in.data() + off;
+        out.resize(12 + lzo1x_bound(len));
+        auto *o = reinterpret_cast<std::uint8_t *>(out.data());
+        std::size_t clen = lzo1x_compress(src, len, o + 12);
+        put_be32(o, static_cast<std::uint32_t>(len));
+        put_be32(o + 8, static_cast<std::uint32_t>(adler32(1, src, static_cast<uInt>(len))));
+        if (clen < len) {
+            put_be32(o + 4, static_cast<std::uint32_t>(clen));
+            out.resize(12 + clen);
+        } else {
+            // Incompressible: stored as is
+            put_be32(o + 4, static_cast<std::uint32_t>(len));
+            std::memcpy(o + 12, src, len);
+            out.resize(12 + len);
+        }
+    });
+    const std::uint8_t eof[4] = {};
+    write_all(out_fd, eof, sizeof(eof));
+}
+
+struct lzop_block {
+    std::size_t in_off;
+    std::uint32_t src_len;
+    std::uint32_t dst_len;
+    std::uint32_t d_sum;
+};
+
+// Every LZOP block header carries its decompressed size, so the whole stream is
+// indexed first and the blocks are then decoded concurrently to their final offsets.
+void lzop_decompress(byte_view in, int out_fd) {
+    const std::uint8_t *const data = in.data();
+    const std::size_t size = in.size();
+    std::size_t off = 0;
+    auto need = [&](std::size_t n) {
+        if (size - off < n) {
+            LOGE("magiskboot: LZOP stream truncated\n");
+            throw std::runtime_error("LZOP stream truncated");
+        }
+    };
+    auto be16 = [&] { need(2); off += 2; return static_cast<unsigned>(data[off - 2] << 8 | data[off - 1]); };
+    auto be32 = [&] { need(4); off += 4; return read_be32(data + off - 4); };
+
+    need(sizeof(LZOP_FILE_MAGIC));
+    if (std::memcmp(data, LZOP_FILE_MAGIC, sizeof(LZOP_FILE_MAGIC)) != 0) {
+        LOGE("magiskboot: LZOP bad magic\n");
+        throw std::runtime_error("LZOP bad magic");
+    }
+    off = sizeof(LZOP_FILE_MAGIC);
+    const std::size_t hdr_start = off;
+    const unsigned version = be16();
+    be16();  /* library version */
+    if (version >= 0x0940)
+        be16();  /* version needed to extract */
+    need(1);
+    const unsigned method = data[off++];
+    if (method < 1 || method > 3) {
+        LOGE("magiskboot: LZOP method %u is not LZO1X\n", method);
+        throw std::runtime_error("LZOP method unsupported");
+    }
+    if (version >= 0x0940) {
+        need(1);
+        ++off;  /* level */
+    }
+    const std::uint32_t flags = be32();
+    if (flags & LZOP_F_H_FILTER) {
+        LOGE("magiskboot: LZOP filters are not supported\n");
+        throw std::runtime_error("LZOP filter unsupported");
+    }
+    be32();  /* mode */
+    be32();  /* mtime low */
+    if (version >= 0x0940)
+        be32();  /* mtime high */
+    need(1);
+    const std::size_t name_len = data[off];
+    need(1 + name_len);
+    off += 1 + name_len;  /* file name */
+    const std::uint32_t hdr_sum = (flags & LZOP_F_H_CRC32)
+            ? static_cast<std::uint32_t>(crc32(0, data + hdr_start, static_cast<uInt>(off - hdr_start)))
+            : static_cast<std::uint32_t>(adler32(1, data + hdr_start, static_cast<uInt>(off - hdr_start)));
+    if (be32() != hdr_sum) {
+        LOGE("magiskboot: LZOP header checksum mismatch\n");
+        throw std::runtime_error("LZOP header corrupted");
+    }
+    if (flags & LZOP_F_H_EXTRA_FIELD) {
+        const std::uint32_t extra = be32();
+        need(extra);
+        off += extra;
+        be32();  /* extra field checksum */
+    }
+
+    std::vector<lzop_block> blocks;
+    std::size_t total_out = 0;
+    for (;;) {
+        const std::uint32_t dst_len = be32();
+        if (dst_len == 0)
+            break;
+        const std::uint32_t src_len = be32();
+        if (dst_len > LZOP_BLOCK_MAX || src_len == 0 || src_len > dst_len) {
+            LOGE("magiskboot: LZOP block %zu has bad sizes (%u -> %u)\n", blocks.size(), src_len, dst_len);
+            throw std::runtime_error("LZOP block corrupted");
+        }
+        std::uint32_t d_sum = 0;
+        if (flags & LZOP_F_ADLER32_D)
+            d_sum = be32();
+        if (flags & LZOP_F_CRC32_D)
+            d_sum = be32();  /* with both present, the CRC-32 is the one checked */
+        if (src_len < dst_len) {
+            if (flags & LZOP_F_ADLER32_C)
+                be32();
+            if (flags & LZOP_F_CRC32_C)
+                be32();
+        }
+        need(src_len);
+        blocks.push_back({off, src_len, dst_len, d_sum});
+        off += src_len;
+        total_out += dst_len;
+        if (total_out > LZ4_LEGACY_DECOMP_TOTAL_MAX) {
+            LOGE("magiskboot: LZOP total decompressed size exceeds %zu\n", LZ4_LEGACY_DECOMP_TOTAL_MAX);
+            throw std::runtime_error("LZOP decompress output too large");
+        }
+    }
+
+    const bool check = flags & (LZOP_F_ADLER32_D | LZOP_F_CRC32_D);
+    write_sized_blocks(
+            blocks.size(), out_fd, [&](std::size_t i) { return blocks[i].dst_len; },
+            [&](std::size_t i, char *out) {
+                const auto &b = blocks[i];
+                auto *o = reinterpret_cast<std::uint8_t *>(out);
+                if (b.src_len == b.dst_len) {
+                    std::memcpy(o, data + b.in_off, b.dst_len);
+                } else if (!lzo1x_decompress(data + b.in_off, b.src_len, o, b.dst_len)) {
+                    LOGE("magiskboot: LZOP block %zu is corrupted\n", i);
+                    throw std::runtime_error("LZOP decompress failed");
+                }
+                if (check) {
+                    const std::uint32_t sum = (flags & LZOP_F_CRC32_D)
+                            ? static_cast<std::uint32_t>(crc32(0, o, b.dst_len))
+                            : static_cast<std::uint32_t>(adler32(1, o, b.dst_len));
+                    if (sum != b.d_sum) {
+                        LOGE("magiskboot: LZOP block %zu checksum mismatch\n", i);
+                        throw std::runtime_error("LZOP checksum mismatch");
+                    }
+                }
+            });
+}
+
+#ifdef USE_LZMA
+// ===========================
+// XZ / LZMA via liblzma
+// ===========================
+
+// XZ output is split into blocks of this size so the encoder can work on them in
+// parallel. The block size is fixed (not derived from the thread count), so the
+// output is the same however many threads run.
+constexpr std::size_t XZ_BLOCK_SIZE = 8 * 1024 * 1024;
+
+// Optional branch/call filter placed in front of LZMA2, matching the
+// `xz --x86/--arm/--armthumb/--arm64` options kernel builds use. Selected with
+// MAGISKBOOT_XZ_BCJ; the target kernel must have the matching XZ_DEC_* decoder.
+lzma_vli xz_bcj_filter() {
+    const char *env = getenv("MAGISKBOOT_XZ_BCJ");
+    if (env == nullptr || *env == '\0' || std::strcmp(env, "none") == 0)
+        return LZMA_VLI_UNKNOWN;
+    if (std::strcmp(env, "x86") == 0)
+        return LZMA_FILTER_X86;
+    if (std::strcmp(env, "arm") == 0)
+        return LZMA_FILTER_ARM;
+    if (std::strcmp(env, "armthumb") == 0)
+        return LZMA_FILTER_ARMTHUMB;
+#ifdef LZMA_FILTER_ARM64
+    if (std::strcmp(env, "arm64") == 0)
+        return LZMA_FILTER_ARM64;
+#endif
+    LOGW("magiskboot: unsupported MAGISKBOOT_XZ_BCJ=%s, using no BCJ filter\n", env);
+    return LZMA_VLI_UNKNOWN;
+}
+
+void lzma_run(lzma_stream &strm, byte_view in, int out_fd, lzma_action action) {
+    std::array<std::uint8_t, 64 * 1024> out_buf{};
+    strm.next_in = in.data();
+    strm.avail_in = in.size();
+    lzma_ret ret;
+    do {
+        strm.next_out = out_buf.data();
+        strm.avail_out = out_buf.size();
+        ret = lzma_code(&strm, strm.avail_in ? LZMA_RUN : action);
+        if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
+            lzma_end(&strm);
+            LOGE("lzma_code failed (%d)\n", static_cast<int>(ret));
+            throw std::runtime_error("lzma failed");
+        }
+        const std::size_t have = out_buf.size() - strm.avail_out;
+        if (have > 0 && xwrite(out_fd, out_buf.data(), have) < 0) {
+            lzma_end(&strm);
+            throw std::runtime_error("write failed");
+        }
+    } while (ret != LZMA_STREAM_END);
+    lzma_end(&strm);
+}
+
+void xz_compress(byte_view in, int out_fd, bool legacy) {
+    lzma_options_lzma opt;
+    if (lzma_lzma_preset(&opt, 9)) {
+        throw std::runtime_error("lzma preset failed");
+    }
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_ret ret;
+    if (legacy) {
+        ret = lzma_alone_encoder(&strm, &opt);
+    } else {
+        opt.dict_size = std::min<std::uint32_t>(opt.dict_size, XZ_BLOCK_SIZE);
+        lzma_filter filters[3];
+        int n = 0;
+        if (lzma_vli bcj = xz_bcj_filter(); bcj != LZMA_VLI_UNKNOWN) {
+            filters[n++] = {bcj, nullptr};
+        }
+        filters[n++] = {LZMA_FILTER_LZMA2, &opt};
+        filters[n] = {LZMA_VLI_UNKNOWN, nullptr};
+
+        lzma_mt mt{};
+        mt.threads = worker_threads();
+        mt.block_size = XZ_BLOCK_SIZE;
+        mt.filters = filters;
+        mt.check = LZMA_CHECK_CRC32;  /* what the kernel's XZ decoder expects */
+        ret = lzma_stream_encoder_mt(&strm, &mt);
+        if (ret == LZMA_OPTIONS_ERROR || ret == LZMA_UNSUPPORTED_CHECK || ret == LZMA_PROG_ERROR) {
+            // liblzma built without threading support
+            ret = lzma_stream_encoder(&strm, filters, LZMA_CHECK_CRC32);
+        }
+    }
+    if (ret != LZMA_OK) {
+        LOGE("lzma encoder init failed (%d)\n", static_cast<int>(ret));
+        throw std::runtime_error("lzma encoder init failed");
+    }
+    lzma_run(strm, in, out_fd, LZMA_FINISH);
+}
+
+void xz_decompress(byte_view in, int out_fd, bool legacy) {
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_ret ret;
+    if (legacy) {
+        ret = lzma_alone_decoder(&strm, UINT64_MAX);
+    } else {
+#if LZMA_VERSION >= 50040002
+        // Multi-block streams (as written by xz_compress) decode in parallel.
+        lzma_mt mt{};
+        mt.threads = worker_threads();
+        mt.memlimit_threading = UINT64_MAX;
+        mt.memlimit_stop = UINT64_MAX;
+        ret = lzma_stream_decoder_mt(&strm, &mt);
+#else
+        ret = lzma_stream_decoder(&strm, UINT64_MAX, 0);
+#endif
+    }
+    if (ret != LZMA_OK) {
+        LOGE("lzma decoder init failed (%d)\n", static_cast<int>(ret));
+        throw std::runtime_error("lzma decoder init failed");
+    }
+    lzma_run(strm, in, out_fd, LZMA_RUN);
+}
+#endif // USE_LZMA
+
+#ifdef USE_BZIP2
+// ===========================
+// BZIP2 via libbz2
+// ===========================
+
+constexpr std::uint64_t BZ_BLOCK_MAGIC = 0x314159265359;  // pi
+constexpr std::uint64_t BZ_EOS_MAGIC = 0x177245385090;    // sqrt(pi)
+constexpr std::uint64_t BZ_MAGIC_MASK = (std::uint64_t{1} << 48) - 1;
+constexpr int BZ_LEVEL = 9;
+// Input per parallel compression job. The first RLE stage can grow data by 5/4,
+// so this always fits in one level-9 block (900000 - 19 bytes).
+constexpr std::size_t BZ_CHUNK = 700 * 1024;
+
+// Big-endian bit reader and writer over bzip2's MSB-first bit stream.
+std::uint32_t bz_bits(const std::uint8_t *p, std::size_t size, std::uint64_t pos, unsigned n) {
+    std::uint64_t v = 0;
+    const std::size_t byte = pos >> 3;
+    for (std::size_t i = 0; i < 8; ++i) {
+        v = (v << 8) | (byte + i < size ? p[byte + i] : 0);
+    }
+    return static_cast<std::uint32_t>((v << (pos & 7)) >> (64 - n));
+}
+
+struct bz_writer {
+    std::vector<char> &out;
+    std::uint64_t acc = 0;
+    unsigned nbits = 0;
+
+    void put(std::uint64_t v, unsigned n) {
+        acc = (acc << n) | (v & ((std::uint64_t{1} << n) - 1));
+        nbits += n;
+        while (nbits >= 8) {
+            nbits -= 8;
+            out.push_back(static_cast<char>(acc >> nbits));
+        }
+    }
+    void copy(const std::uint8_t *p, std::size_t size, std::uint64_t from, std::uint64_t to) {
+        if (nbits == 0) {
+            // Byte-aligned output: shift whole bytes across.
+            const unsigned shift = from & 7;
+            const std::size_t n = static_cast<std::size_t>((to - from) >> 3);
+            const std::size_t at = out.size();
+            out.resize(at + n);
+            for (std::size_t k = 0, j = from >> 3; k < n; ++k, ++j) {
+                const unsigned w = (unsigned{p[j]} << 8) | (j + 1 < size ? p[j + 1] : 0u);
+                out[at + k] = static_cast<char>(w >> (8 - shift));
+            }
+            from += std::uint64_t{n} * 8;
+        }
+        for (; to - from >= 32; from += 32) {
+            put(bz_bits(p, size, from, 32), 32);
+        }
+        if (to > from)
+            put(bz_bits(p, size, from, static_cast<unsigned>(to - from)), static_cast<unsigned>(to - from));
+    }
+    void finish() {
+        if (nbits > 0)
+            put(0, 8 - nbits);
+    }
+};
+
+void bz_check(int ret, const char *what) {
+    if (ret != BZ_OK && ret != BZ_RUN_OK && ret != BZ_FINISH_OK && ret != BZ_STREAM_END) {
+        LOGE("%s failed (%d)\n", what, ret);
+        throw std::runtime_error("bzip2 failed");
+    }
+}
+
+// Compress `len` bytes as one complete bzip2 stream into `out`.
+void bz_compress_stream(const char *src, std::size_t len, std::vector<char> &out) {
+    bz_stream strm{};
+    bz_check(BZ2_bzCompressInit(&strm, BZ_LEVEL, 0, 0), "BZ2_bzCompressInit");
+    out.resize(len + len / 100 + 600);
+    strm.next_in = const_cast<char *>(src);
+    strm.avail_in = static_cast<unsigned>(len);
+    int ret;
+    do {
+        if (strm.total_out_lo32 == out.size())
+            out.resize(out.size() * 2);
+        strm.next_out = out.data() + strm.total_out_lo32;
+        strm.avail_out = static_cast<unsigned>(out.size() - strm.total_out_lo32);
+        ret = BZ2_bzCompress(&strm, BZ_FINISH);
+        if (ret < 0)
+            BZ2_bzCompressEnd(&strm);
+        bz_check(ret, "BZ2_bzCompress");
+    } while (ret != BZ_STREAM_END);
+    out.resize(strm.total_out_lo32);
+    BZ2_bzCompressEnd(&strm);
+}
+
+// Large inputs are cut into BZ_CHUNK pieces compressed as separate streams in
+// parallel. Each yields exactly one block; the blocks are then spliced at bit level
+// into a single stream with a recomputed combined CRC, since the kernel's bunzip2
+// stops after the first stream.
+void bzip2_compress(byte_view in, int out_fd) {
+    const auto *src = reinterpret_cast<const char *>(in.data());
+    if (worker_threads() <= 1 || in.size() <= BZ_CHUNK) {
+        std::vector<char> out;
+        bz_compress_stream(src, in.size(), out);
+        write_all(out_fd, out.data(), out.size());
+        return;
+    }
+    const std::size_t count = (in.size() + BZ_CHUNK - 1) / BZ_CHUNK;
+    std::vector<std::vector<char>> streams(count);
+    std::vector<std::uint64_t> ends(count);
+    parallel_for(count, [&](std::size_t i) {
+        const std::size_t off = i * BZ_CHUNK;
+        auto &s = streams[i];
+        bz_compress_stream(src + off, std::min(BZ_CHUNK, in.size() - off), s);
+        // The stream ends with the EOS magic, the 32-bit CRC and 0-7 zero pad bits.
+        const auto *p = reinterpret_cast<const std::uint8_t *>(s.data());
+        const std::uint64_t bits = std::uint64_t{s.size()} * 8;
+        for (unsigned pad = 0; pad < 8; ++pad) {
+            const std::uint64_t eos = bits - pad - 80;
+            const std::uint64_t magic = (std::uint64_t{bz_bits(p, s.size(), eos, 24)} << 24) |
+                                        bz_bits(p, s.size(), eos + 24, 24);
+            if (magic == BZ_EOS_MAGIC && (pad == 0 || bz_bits(p, s.size(), bits - pad, pad) == 0)) {
+                ends[i] = eos;
+                return;
+            }
+        }
+        throw std::runtime_error("bzip2: cannot locate end of stream");
+    });
+
+    std::vector<char> out{'B', 'Z', 'h', static_cast<char>('0' + BZ_LEVEL)};
+    out.reserve(in.size() / 4);
+    bz_writer w{out};
+    std::uint32_t combined = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        const auto *p = reinterpret_cast<const std::uint8_t *>(streams[i].data());
+        const std::uint32_t crc = bz_bits(p, streams[i].size(), 32 + 48, 32);
+        combined = ((combined << 1) | (combined >> 31)) ^ crc;
+        w.copy(p, streams[i].size(), 32, ends[i]);
+        if (out.size() > 16 * 1024 * 1024) {
+            write_all(out_fd, out.data(), out.size());
+            out.clear();
+        }
+    }
+    w.put(BZ_EOS_MAGIC, 48);
+    w.put(combined, 32);
+    w.finish();
+    write_all(out_fd, out.data(), out.size());
+}
+
+void bzip2_decompress_serial(byte_view in, int out_fd) {
+    std::array<char, 64 * 1024> out_buf{};
+    std::size_t off = 0;
+    // Concatenated streams (pbzip2 output) are decoded one after another.
+    while (off + 4 <= in.size() && std::memcmp(in.data() + off, "BZh", 3) == 0) {
+        bz_stream strm{};
+        bz_check(BZ2_bzDecompressInit(&strm, 0, 0), "BZ2_bzDecompressInit");
+        strm.next_in = const_cast<char *>(reinterpret_cast<const char *>(in.data() + off));
+        strm.avail_in = static_cast<unsigned>(in.size() - off);
+        int ret;
+        do {
+            strm.next_out = out_buf.data();
+            strm.avail_out = out_buf.size();
+            ret = BZ2_bzDecompress(&strm);
+            if (ret != BZ_OK && ret != BZ_STREAM_END) {
+                BZ2_bzDecompressEnd(&strm);
+                LOGE("BZ2_bzDecompress failed (%d)\n", ret);
+                throw std::runtime_error("bzip2 decompress failed");
+            }
+            if (ret == BZ_OK && strm.avail_in == 0 && strm.avail_out != 0) {
+                BZ2_bzDecompressEnd(&strm);
+                LOGE("magiskboot: bzip2 stream truncated\n");
+                throw std::runtime_error("bzip2 stream truncated");
+            }
+            write_all(out_fd, out_buf.data(), out_buf.size() - strm.avail_out);
+        } while (ret != BZ_STREAM_END);
+        off = in.size() - strm.avail_in;
+        BZ2_bzDecompressEnd(&strm);
+    }
+}
+
+struct bz_block {
+    std::uint64_t start;  /* bit offset of the block magic */
+    std::uint64_t end;    /* bit offset of the next block or EOS magic */
+    char level;
+};
+
+// Bit offsets of every block and end-of-stream magic, in stream order. The input is
+// scanned in slices on the worker pool; hits inside compressed data are possible and
+// are weeded out later by the CRC checks.
+std::vector<std::uint64_t> bz_find_magics(byte_view in) {
+    constexpr std::size_t SLICE = 1024 * 1024;
+    const std::size_t slices = (in.size() + SLICE - 1) / SLICE;
+    // Any magic that ends in byte i fully covers byte i - 2, so a 256-entry table of
+    // the values that byte can take rejects almost every position up front.
+    std::array<bool, 256> maybe{};
+    for (unsigned k = 0; k < 8; ++k) {
+        maybe[((BZ_BLOCK_MAGIC << k) >> 16) & 0xff] = true;
+        maybe[((BZ_EOS_MAGIC << k) >> 16) & 0xff] = true;
+    }
+    std::vector<std::vector<std::uint64_t>> hits(slices);
+    parallel_for(slices, [&](std::size_t s) {
+        const std::size_t begin = s * SLICE;
+        const std::size_t end = std::min(in.size(), begin + SLICE);
+        // Prime with the 7 bytes before the slice so magics straddling it are seen once.
+        std::uint64_t acc = 0;
+        for (std::size_t i = begin >= 7 ? begin - 7 : 0; i < begin; ++i) {
+            acc = (acc << 8) | in.data()[i];
+        }
+        for (std::size_t i = begin; i < end; ++i) {
+            acc = (acc << 8) | in.data()[i];
+            if (!maybe[(acc >> 16) & 0xff])
+                continue;
+            // acc holds bits up to the end of byte i; check the 8 magics that end in it.
+            for (unsigned k = 8; k-- > 0;) {
+                const std::uint64_t v = (acc >> k) & BZ_MAGIC_MASK;
+                if ((v == BZ_BLOCK_MAGIC || v == BZ_EOS_MAGIC) && (i + 1) * 8 >= 48 + k) {
+                    hits[s].push_back((i + 1) * 8 - k - 48);
+                }
+            }
+        }
+    });
+    std::vector<std::uint64_t> all;
+    for (auto &h : hits) {
+        all.insert(all.end(), h.begin(), h.end());
+    }
+    return all;
+}
+
+// Split the input into its blocks. Returns false if the stream layout does not add
+// up (e.g. a false magic hit), in which case the caller decodes serially.
+bool bz_index_blocks(byte_view in, std::vector<bz_block> &blocks) {
+    const auto magics = bz_find_magics(in);
+    const std::uint8_t *p = in.data();
+    const std::size_t size = in.size();
+    auto magic_at = [&](std::uint64_t bit) {
+        return (std::uint64_t{bz_bits(p, size, bit, 24)} << 24) | bz_bits(p, size, bit + 24, 24);
+    };
+    std::size_t m = 0;
+    std::size_t off = 0;
+    while (off + 4 <= size && std::memcmp(p + off, "BZh", 3) == 0) {
+        const char level = static_cast<char>(p[off + 3]);
+        if (level < '1' || level > '9')
+            return false;
+        std::uint64_t bit = std::uint64_t{off} * 8 + 32;
+        std::uint32_t combined = 0;
+        while (m < magics.size() && magics[m] < bit)
+            ++m;
+        for (;;) {
+            if (m >= magics.size() || magics[m] != bit)
+                return false;
+            if (magic_at(bit) == BZ_EOS_MAGIC)
+                break;
+            // Skip hits inside this block until the next candidate boundary.
+            const std::uint32_t crc = bz_bits(p, size, bit + 48, 32);
+            combined = ((combined << 1) | (combined >> 31)) ^ crc;
+            ++m;
+            while (m < magics.size() && magics[m] < bit + 80)
+                ++m;
+            if (m >= magics.size())
+                return false;
+            blocks.push_back({bit, magics[m], level});
+            bit = magics[m];
+        }
+        if (bit + 80 > std::uint64_t{size} * 8 || bz_bits(p, size, bit + 48, 32) != combined)
+            return false;
+        off = static_cast<std::size_t>((bit + 80 + 7) / 8);
+        ++m;
+    }
+    return !blocks.empty();
+}
+
+// Each block is rebuilt as a standalone single-block stream and decoded on its own.
+void bz_decode_block(byte_view in, const bz_block &b, std::vector<char> &out) {
+    std::vector<char> stream{'B', 'Z', 'h', b.level};
+    stream.reserve(static_cast<std::size_t>((b.end - b.start) / 8 + 16));
+    bz_writer w{stream};
+    w.copy(in.data(), in.size(), b.start, b.end);
+    w.put(BZ_EOS_MAGIC, 48);
+    w.put(bz_bits(in.data(), in.size(), b.start + 48, 32), 32);
+    w.finish();
+
+    bz_stream strm{};
+    bz_check(BZ2_bzDecompressInit(&strm, 0, 0), "BZ2_bzDecompressInit");
+    strm.next_in = stream.data();
+    strm.avail_in = static_cast<unsigned>(stream.size());
+    out.resize(static_cast<std::size_t>(b.level - '0') * 100000);
+    int ret;
+    do {
+        if (strm.total_out_lo32 == out.size())
+            out.resize(out.size() * 2);
+        strm.next_out = out.data() + strm.total_out_lo32;
+        strm.avail_out = static_cast<unsigned>(out.size() - strm.total_out_lo32);
+        ret = BZ2_bzDecompress(&strm);
+        if (ret != BZ_STREAM_END && (ret != BZ_OK || (strm.avail_in == 0 && strm.avail_out != 0))) {
+            BZ2_bzDecompressEnd(&strm);
+            throw std::runtime_error("bzip2 block decode failed");
+        }
+    } while (ret != BZ_STREAM_END);
+    out.resize(strm.total_out_lo32);
+    BZ2_bzDecompressEnd(&strm);
+}
+
+void bzip2_decompress(byte_view in, int out_fd) {
+    std::vector<bz_block> blocks;
+    if (worker_threads() <= 1 || !bz_index_blocks(in, blocks) || blocks.size() < 2) {
+        bzip2_decompress_serial(in, out_fd);
+        return;
+    }
+    const off_t base = lseek(out_fd, 0, SEEK_CUR);
+    try {
+        write_ordered_blocks(blocks.size(), out_fd, [&](std::size_t i, std::vector<char> &out) {
+            bz_decode_block(in, blocks[i], out);
+        });
+    } catch (const std::runtime_error &) {
+        // A block boundary was misidentified. Start over with the serial decoder,
+        // which reports the error properly if the data really is corrupted.
+        if (base < 0 || lseek(out_fd, base, SEEK_SET) != base || ftruncate(out_fd, base) != 0)
+            throw;
+        bzip2_decompress_serial(in, out_fd);
+    }
+}
+#endif // USE_BZIP2
+
+#ifdef USE_ZSTD
+// ===========================
+// Zstandard via libzstd
+// ===========================
+
+// Level 19 matches what the kernel build uses for zstd initramfs images; override
+// with MAGISKBOOT_ZSTD_LEVEL.
+int zstd_level() {
+    static const int level = [] {
+        const char *env = getenv("MAGISKBOOT_ZSTD_LEVEL");
+        if (env == nullptr || *env == '\0')
+            return 19;
+        return std::clamp(std::atoi(env), ZSTD_minCLevel(), ZSTD_maxCLevel());
+    }();
+    return level;
+}
+
+void zstd_check(std::size_t ret, const char *what) {
+    if (ZSTD_isError(ret)) {
+        LOGE("%s failed: %s\n", what, ZSTD_getErrorName(ret));
+        throw std::runtime_error("zstd failed");
+    }
+}
+
+// One frame with checksum, compressed by libzstd's own worker threads with
+// long-distance matching. The frame records the content size, so the window the
+// decoder needs never exceeds the input size.
+void zstd_compress(byte_view in, int out_fd) {
+    std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx(ZSTD_createCCtx(), &ZSTD_freeCCtx);
+    if (!cctx) {
+        throw std::runtime_error("ZSTD_createCCtx failed");
+    }
+    zstd_check(ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_compressionLevel, zstd_level()), "ZSTD level");
+    zstd_check(ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_checksumFlag, 1), "ZSTD checksum");
+    zstd_check(ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_enableLongDistanceMatching, 1), "ZSTD ldm");
+    if (worker_threads() > 1) {
+        // Fails harmlessly when libzstd was built without ZSTD_MULTITHREAD.
+        ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_nbWorkers, static_cast<int>(worker_threads()));
+    }
+    zstd_check(ZSTD_CCtx_setPledgedSrcSize(cctx.get(), in.size()), "ZSTD pledged size");
+
+    std::vector<char> out_buf(ZSTD_CStreamOutSize());
+    ZSTD_inBuffer input{in.data(), in.size(), 0};
+    std::size_t remaining;
+    do {
+        ZSTD_outBuffer output{out_buf.data(), out_buf.size(), 0};
+        remaining = ZSTD_compressStream2(cctx.get(), &output, &input, ZSTD_e_end);
+        zstd_check(remaining, "ZSTD_compressStream2");
+        write_all(out_fd, out_buf.data(), output.pos);
+    } while (remaining != 0);
+}
+
+ZSTD_DCtx *zstd_dctx_new() {
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    if (dctx == nullptr) {
+        throw std::runtime_error("ZSTD_createDCtx failed");
+    }
+    // Accept frames with windows past the 128MB default (e.g. `zstd --long=31`).
+    ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, ZSTD_dParam_getBounds(ZSTD_d_windowLogMax).upperBound);
+    return dctx;
+}
+
+// True if a zstd frame (regular or skippable) starts at p. Data after the last frame,
+// such as partition padding, is ignored like the other decoders do.
+bool zstd_frame_at(const std::uint8_t *p, std::size_t len) {
+    if (len < 4)
+        return false;
+    const std::uint32_t magic = read_le32(p);
+    return magic == ZSTD_MAGICNUMBER || (magic & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START;
+}
+
+void zstd_decompress_stream(byte_view in, int out_fd) {
+    std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(zstd_dctx_new(), &ZSTD_freeDCtx);
+    std::vector<char> out_buf(ZSTD_DStreamOutSize());
+    ZSTD_inBuffer input{in.data(), in.size(), 0};
+    std::size_t ret = 1;
+    while (ret != 0 || zstd_frame_at(in.data() + input.pos, in.size() - input.pos)) {
+        const std::size_t consumed = input.pos;
+        ZSTD_outBuffer output{out_buf.data(), out_buf.size(), 0};
+        ret = ZSTD_decompressStream(dctx.get(), &output, &input);
+        zstd_check(ret, "ZSTD_decompressStream");
+        if (output.pos == 0 && input.pos == consumed) {
+            LOGE("magiskboot: zstd stream truncated\n");
+            throw std::runtime_error("zstd stream truncated");
+        }
+        write_all(out_fd, out_buf.data(), output.pos);
+    }
+}
+
+struct zstd_frame {
+    std::size_t in_off;
+    std::size_t in_size;
+    std::size_t out_size;
+};
+
+// Multi-frame streams (pzstd output or concatenated files) whose frames all record their content size are decoded frame by frame in
+// parallel. Anything else goes through the streaming decoder.
+void zstd_decompress(byte_view in, int out_fd) {
+    std::vector<zstd_frame> frames;
+    std::size_t total = 0;
+    for (std::size_t off = 0; zstd_frame_at(in.data() + off, in.size() - off);) {
+        const std::size_t csize = ZSTD_findFrameCompressedSize(in.data() + off, in.size() - off);
+        const unsigned long long dsize = ZSTD_getFrameContentSize(in.data() + off, in.size() - off);
+        if (ZSTD_isError(csize) || dsize == ZSTD_CONTENTSIZE_UNKNOWN || dsize == ZSTD_CONTENTSIZE_ERROR ||
+            dsize > LZ4_LEGACY_DECOMP_TOTAL_MAX - total) {
+            frames.clear();
+            break;
+        }
+        frames.push_back({off, csize, static_cast<std::size_t>(dsize)});
+        total += static_cast<std::size_t>(dsize);
+        off += csize;
+    }
+    if (worker_threads() <= 1 || frames.size() < 2) {
+        zstd_decompress_stream(in, out_fd);
+        return;
+    }
+    write_sized_blocks(
+            frames.size(), out_fd, [&](std::size_t i) { return frames[i].out_size; },
+            [&](std::size_t i, char *out) {
+                thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(zstd_dctx_new(), &ZSTD_freeDCtx);
+                const auto &f = frames[i];
+                const std::size_t n = ZSTD_decompressDCtx(dctx.get(), out, f.out_size, in.data() + f.in_off, f.in_size);
+                zstd_check(n, "ZSTD_decompressDCtx");
+                if (n != f.out_size) {
+                    LOGE("magiskboot: zstd frame %zu size mismatch\n", i);
+                    throw std::runtime_error("zstd decompress failed");
+                }
+            });
+}
+#endif // USE_ZSTD
+
 } // namespace
 
 void compress_bytes(FileFormat format, byte_view in_bytes, int out_fd) {
@@ -307,6 +1734,25 @@ void compress_bytes(FileFormat format, byte_view in_bytes, int out_fd) {
         case FileFormat::LZ4_LG:
             lz4_legacy_compress(in_bytes, out_fd);
             break;
+#ifdef USE_LZMA
+        case FileFormat::XZ:
+        case FileFormat::LZMA:
+            xz_compress(in_bytes, out_fd, format == FileFormat::LZMA);
+            break;
+#endif
+#ifdef USE_BZIP2
+        case FileFormat::BZIP2:
+            bzip2_compress(in_bytes, out_fd);
+            break;
+#endif
+        case FileFormat::LZOP:
+            lzop_compress(in_bytes, out_fd);
+            break;
+#ifdef USE_ZSTD
+        case FileFormat::ZSTD:
+            zstd_compress(in_bytes, out_fd);
+            break;
+#endif
         default:
             unsupported_format("compress", format);
     }
@@ -325,6 +1771,25 @@ void decompress_bytes(FileFormat format, byte_view in_bytes, int out_fd) {
         case FileFormat::LZ4_LG:
             lz4_legacy_decompress(in_bytes, out_fd);
             break;
+#ifdef USE_LZMA
+        case FileFormat::XZ:
+        case FileFormat::LZMA:
+            xz_decompress(in_bytes, out_fd, format == FileFormat::LZMA);
+            break;
+#endif
+#ifdef USE_BZIP2
+        case FileFormat::BZIP2:
+            bzip2_decompress(in_bytes, out_fd);
+            break;
+#endif
+        case FileFormat::LZOP:
+            lzop_decompress(in_bytes, out_fd);
+            break;
+#ifdef USE_ZSTD
+        case FileFormat::ZSTD:
+            zstd_decompress(in_bytes, out_fd);
+            break;
+#endif
         default:
             unsupported_format("decompress", format);
     }
@@ -346,6 +1811,7 @@ const char *fmt2name(FileFormat fmt) {
         case FileFormat::LZ4_LEGACY: return "LZ4_LEGACY";
         case FileFormat::LZ4_LG:     return "LZ4_LG";
         case FileFormat::LZOP:       return "LZOP";
+        case FileFormat::ZSTD:       return "ZSTD";
         case FileFormat::MTK:        return "MTK";
         case FileFormat::DTB:        return "DTB";
         case FileFormat::ZIMAGE:     return "ZIMAGE";
@@ -355,6 +1821,20 @@ const char *fmt2name(FileFormat fmt) {
     }
 }
 
+FileFormat name2fmt(const char *name) {
+    for (auto fmt : {FileFormat::GZIP, FileFormat::ZOPFLI, FileFormat::XZ, FileFormat::LZMA,
+                     FileFormat::BZIP2, FileFormat::LZ4, FileFormat::LZ4_LEGACY, FileFormat::LZ4_LG,
+                     FileFormat::LZOP, FileFormat::ZSTD}) {
+        const char *n = fmt2name(fmt);
+        std::size_t i = 0;
+        while (n[i] != '\0' && std::toupper(static_cast<unsigned char>(name[i])) == n[i])
+            ++i;
+        if (n[i] == '\0' && name[i] == '\0')
+            return fmt;
+    }
+    return FileFormat::UNKNOWN;
+}
+
 bool fmt_compressed(FileFormat fmt) {
     switch (fmt) {
         case FileFormat::GZIP:
@@ -366,6 +1846,7 @@ bool fmt_compressed(FileFormat fmt) {
         case FileFormat::LZ4_LEGACY:
         case FileFormat::LZ4_LG:
         case FileFormat::LZOP:
+        case FileFormat::ZSTD:
             return true;
         default:
             return false;
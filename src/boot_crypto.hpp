@@ -25,18 +25,20 @@ enum class FileFormat : std::uint8_t {
     LZ4_LEGACY = 12,
     LZ4_LG = 13,
     LZOP = 14,
+    ZSTD = 15,
     /* Misc */
-    MTK = 15,
-    DTB = 16,
-    ZIMAGE = 17,
+    MTK = 16,
+    DTB = 17,
+    ZIMAGE = 18,
 };
 
-// SHA helper using an external crypto library (OpenSSL if enabled).
+// SHA helper backed by OpenSSL if enabled, else the built-in sha.hpp implementation.
 class SHA {
 public:
     enum class Algorithm {
         SHA1,
         SHA256,
+        SHA512,
     };
 
     explicit SHA(Algorithm algo);
@@ -53,12 +55,14 @@ private:
 std::unique_ptr<SHA> get_sha(bool use_sha1);
 void sha256_hash(byte_view data, byte_data out);
 
-// Compression helpers (gzip only in this standalone version).
+// Compression helpers. Formats whose codec is not compiled in exit with an error.
 void compress_bytes(FileFormat format, byte_view in_bytes, int out_fd);
 void decompress_bytes(FileFormat format, byte_view in_bytes, int out_fd);
 
 // Format helpers
 const char *fmt2name(FileFormat fmt);
+// Compression format for a name as printed by fmt2name (case-insensitive), or UNKNOWN.
+FileFormat name2fmt(const char *name);
 bool fmt_compressed(FileFormat fmt);
 bool fmt_compressed_any(FileFormat fmt);
 
@@ -1,11 +1,23 @@
 #include <functional>
+#include <list>
+#include <map>
 #include <memory>
 #include <string_view>
 #include <vector>
 
+#include <xxhash.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "avb.hpp"
 #include "base_host.hpp"
 #include "boot_crypto.hpp"
 #include "bootimg.hpp"
+#include "cpio.hpp"
 #include "magiskboot.hpp"
 
 using namespace std;
@@ -23,13 +35,6 @@ static void decompress(FileFormat type, int fd, const void *in, size_t size) {
     decompress_bytes(type, byte_view{in, size}, fd);
 }
 
-static off_t compress_len(FileFormat type, byte_view in, int fd) {
-    auto prev = lseek(fd, 0, SEEK_CUR);
-    compress_bytes(type, in, fd);
-    auto now = lseek(fd, 0, SEEK_CUR);
-    return now - prev;
-}
-
 static void dump(const void *buf, size_t size, const char *filename) {
     if (size == 0)
         return;
@@ -38,20 +43,59 @@ static void dump(const void *buf, size_t size, const char *filename) {
     close(fd);
 }
 
-static size_t restore(int fd, const char *filename) {
-    int ifd = xopen(filename, O_RDONLY);
-    size_t size = lseek(ifd, 0, SEEK_END);
-    lseek(ifd, 0, SEEK_SET);
-    xsendfile(fd, ifd, nullptr, size);
-    close(ifd);
-    return size;
-}
-
 static bool check_env(const char *name) {
     const char *val = getenv(name);
     return val != nullptr && string_view(val) == "true";
 }
 
+// MAGISKBOOT_RAMDISK_FMT=<format> (e.g. zstd) recompresses ramdisks in that format on
+// repack instead of the one they were unpacked from. Returns UNKNOWN when unset.
+static FileFormat ramdisk_fmt_override() {
+    const char *name = getenv("MAGISKBOOT_RAMDISK_FMT");
+    if (name == nullptr || *name == '\0')
+        return FileFormat::UNKNOWN;
+    FileFormat fmt = name2fmt(name);
+    if (fmt == FileFormat::UNKNOWN)
+        fprintf(stderr, "repack: ignoring unknown MAGISKBOOT_RAMDISK_FMT [%s]\n", name);
+    return fmt;
+}
+
+// Unpack records in HASH_FILE, for each component it decompressed, the size and XXH64 of
+// the compressed source bytes and of the file written. Repack copies the original bytes
+// for files that still match instead of recompressing them.
+static string content_sig(byte_view src, const byte_data &file) {
+    char buf[80];
+    ssprintf(buf, sizeof(buf), "%zu %016llx %zu %016llx",
+             src.size(), static_cast<unsigned long long>(XXH64(src.data(), src.size(), 0)),
+             file.size(), static_cast<unsigned long long>(XXH64(file.data(), file.size(), 0)));
+    return buf;
+}
+
+static void dump_hash_file(const map<string, string> &sigs) {
+    if (sigs.empty()) {
+        unlink(HASH_FILE);
+        return;
+    }
+    FILE *fp = xfopen(HASH_FILE, "w");
+    if (!fp)
+        return;
+    for (auto &[name, sig] : sigs)
+        fprintf(fp, "%s=%s\n", name.c_str(), sig.c_str());
+    fclose(fp);
+}
+
+// MAGISKBOOT_FORCE_RECOMPRESS=true ignores HASH_FILE and always recompresses.
+static map<string, string> load_hash_file() {
+    map<string, string> sigs;
+    if (check_env("MAGISKBOOT_FORCE_RECOMPRESS"))
+        return sigs;
+    parse_prop_file(HASH_FILE, [&](string_view key, string_view value) -> bool {
+        sigs.emplace(key, value);
+        return true;
+    });
+    return sigs;
+}
+
 static bool guess_lzma(const uint8_t *buf, size_t len) {
     if (len <= 13) return false;
     if (memcmp(buf, "\x5d", 1) != 0) return false;
@@ -83,6 +127,8 @@ FileFormat check_fmt(const void *buf, size_t len) {
         return FileFormat::LZ4;
     } else if (CHECKED_MATCH(LZ4_LEG_MAGIC)) {
         return FileFormat::LZ4_LEGACY;
+    } else if (CHECKED_MATCH(ZSTD_MAGIC)) {
+        return FileFormat::ZSTD;
     } else if (CHECKED_MATCH(MTK_MAGIC)) {
         return FileFormat::MTK;
     } else if (CHECKED_MATCH(DTB_MAGIC)) {
@@ -98,6 +144,51 @@ FileFormat check_fmt(const void *buf, size_t len) {
     }
 }
 
+// Leading byte pairs of the magics boot_img::boot_img acts on: CHROMEOS, BOOT, VENDOR_BOOT,
+// DHTB and TEGRABLOB. check_fmt can only return one of those formats at an address that
+// starts with one of these pairs.
+static constexpr uint8_t locator_magics[][2] = {
+    {'C', 'H'}, {'A', 'N'}, {'V', 'N'}, {'D', 'H'}, {'-', 'S'},
+};
+
+// find_boot_magic: first address in [p, end) where a boot header magic may start, or end.
+static const uint8_t *find_boot_magic(const uint8_t *p, const uint8_t *end) {
+    if (p >= end)
+        return end;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+    for (; end - p > 16; p += 16) {
+#if defined(__SSE2__)
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 1));
+        __m128i hit = _mm_setzero_si128();
+        for (auto &m : locator_magics) {
+            hit = _mm_or_si128(hit, _mm_and_si128(_mm_cmpeq_epi8(a, _mm_set1_epi8(static_cast<char>(m[0]))),
+                                                  _mm_cmpeq_epi8(b, _mm_set1_epi8(static_cast<char>(m[1])))));
+        }
+        if (unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(hit)))
+            return p + __builtin_ctz(mask);
+#else
+        uint8x16_t a = vld1q_u8(p);
+        uint8x16_t b = vld1q_u8(p + 1);
+        uint8x16_t hit = vdupq_n_u8(0);
+        for (auto &m : locator_magics)
+            hit = vorrq_u8(hit, vandq_u8(vceqq_u8(a, vdupq_n_u8(m[0])), vceqq_u8(b, vdupq_n_u8(m[1]))));
+        // Narrow to 4 bits per byte so the first hit is a count of trailing zeros
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+        if (mask)
+            return p + (__builtin_ctzll(mask) >> 2);
+#endif
+    }
+#endif
+    for (; end - p > 1; ++p) {
+        for (auto &m : locator_magics) {
+            if (p[0] == m[0] && p[1] == m[1])
+                return p;
+        }
+    }
+    return end;
+}
+
 void dyn_img_hdr::print() const {
     uint32_t ver = header_version();
     fprintf(stderr, "%-*s [%u]\n", PADDING, "HEADER_VER", ver);
@@ -204,8 +295,12 @@ void dyn_img_hdr::load_hdr_file() {
 boot_img::boot_img(const char *image) :
 map(image), k_fmt(FileFormat::UNKNOWN), r_fmt(FileFormat::UNKNOWN), e_fmt(FileFormat::UNKNOWN) {
     fprintf(stderr, "Parsing boot image: [%s]\n", image);
-    for (const uint8_t *addr = map.data(); addr < map.data() + map.size(); ++addr) {
-        FileFormat fmt = check_fmt(addr, map.size() - (addr - map.data()));
+    // Headers and pre-headers normally sit at offset 0 or right after a DHTB/BLOB header,
+    // which are the first candidates visited; only unusual images need the full scan.
+    const uint8_t *end = map.data() + map.size();
+    for (const uint8_t *addr = find_boot_magic(map.data(), end); addr < end;
+         addr = find_boot_magic(addr + 1, end)) {
+        FileFormat fmt = check_fmt(addr, end - addr);
         switch (fmt) {
         case FileFormat::CHROMEOS:
             flags[CHROMEOS_FLAG] = true;
@@ -245,11 +340,12 @@ struct __attribute__((packed)) fdt_header {
         uint32_t byte2: 8;
         uint32_t byte3: 8;
 
+        // FDT fields are big-endian
         constexpr operator uint32_t() const {
-            return (static_cast<uint32_t>(byte3) << 24) |
-                   (static_cast<uint32_t>(byte2) << 16) |
-                   (static_cast<uint32_t>(byte1) << 8) |
-                   static_cast<uint32_t>(byte0);
+            return (static_cast<uint32_t>(byte0) << 24) |
+                   (static_cast<uint32_t>(byte1) << 16) |
+                   (static_cast<uint32_t>(byte2) << 8) |
+                   static_cast<uint32_t>(byte3);
         }
     };
 
@@ -270,31 +366,48 @@ struct __attribute__((packed)) fdt_header {
     fdt32_t size_dt_struct;
 };
 
-static int find_dtb_offset(const uint8_t *buf, unsigned sz) {
-    const uint8_t * const end = buf + sz;
+// fdt_size: totalsize of the device tree at buf if its header is sane, else 0.
+static uint32_t fdt_size(const uint8_t *buf, size_t avail) {
+    if (avail < sizeof(fdt_header) || !BUFFER_MATCH(buf, DTB_MAGIC))
+        return 0;
+    auto fdt_hdr = reinterpret_cast<const fdt_header *>(buf);
 
-    for (auto curr = buf; curr < end; curr += sizeof(fdt_header)) {
-        curr = static_cast<uint8_t *>(memmem(curr, end - curr, DTB_MAGIC, sizeof(fdt_header::fdt32_t)));
-        if (curr == nullptr)
-            return -1;
+    uint32_t totalsize = fdt_hdr->totalsize;
+    if (totalsize > avail || totalsize <= 0x48)
+        return 0;
 
-        auto fdt_hdr = reinterpret_cast<const fdt_header *>(curr);
+    uint32_t off_dt_struct = fdt_hdr->off_dt_struct;
+    if (off_dt_struct > totalsize - sizeof(fdt_header::fdt32_t) || fdt_hdr->off_dt_strings > totalsize)
+        return 0;
 
-        uint32_t totalsize = fdt_hdr->totalsize;
-        if (totalsize > end - curr || totalsize <= 0x48)
-            continue;
+    auto fdt_node_hdr = reinterpret_cast<const fdt_header::node_header *>(buf + off_dt_struct);
+    if (fdt_node_hdr->tag != 0x1u)
+        return 0;
 
-        uint32_t off_dt_struct = fdt_hdr->off_dt_struct;
-        if (off_dt_struct > end - curr)
-            continue;
+    return totalsize;
+}
 
-        auto fdt_node_hdr = reinterpret_cast<const fdt_header::node_header *>(curr + off_dt_struct);
-        if (fdt_node_hdr->tag != 0x1u)
-            continue;
+vector<byte_view> find_dtbs(byte_view buf, size_t max) {
+    vector<byte_view> dtbs;
+    const uint8_t * const end = buf.data() + buf.size();
 
-        return curr - buf;
+    for (auto curr = buf.data(); curr < end && dtbs.size() < max;) {
+        curr = static_cast<const uint8_t *>(memmem(curr, end - curr, DTB_MAGIC, sizeof(fdt_header::fdt32_t)));
+        if (curr == nullptr)
+            break;
+        if (uint32_t size = fdt_size(curr, end - curr)) {
+            dtbs.emplace_back(curr, size);
+            curr += size;
+        } else {
+            curr += sizeof(fdt_header::fdt32_t);
+        }
     }
-    return -1;
+    return dtbs;
+}
+
+static int find_dtb_offset(const uint8_t *buf, unsigned sz) {
+    auto dtbs = find_dtbs(byte_view(buf, sz), 1);
+    return dtbs.empty() ? -1 : static_cast<int>(dtbs[0].data() - buf);
 }
 
 static FileFormat check_fmt_lg(const uint8_t *buf, unsigned sz) {
@@ -313,6 +426,39 @@ static FileFormat check_fmt_lg(const uint8_t *buf, unsigned sz) {
     return fmt;
 }
 
+// Leading byte pairs of every format check_fmt recognises (ZIMAGE is matched by its magic
+// at offset 0x24 instead), so a scan only calls check_fmt where a magic may start.
+static bool fmt_lead_pair(const uint8_t *p) {
+    static const auto table = [] {
+        array<uint64_t, 65536 / 64> t{};
+        auto add = [&](uint8_t a, uint8_t b) {
+            unsigned i = a << 8 | b;
+            t[i >> 6] |= 1ULL << (i & 63);
+        };
+        for (const char *m : {CHROMEOS_MAGIC, BOOT_MAGIC, VENDOR_BOOT_MAGIC, GZIP1_MAGIC, GZIP2_MAGIC,
+                              LZOP_MAGIC, XZ_MAGIC, BZIP_MAGIC, LZ41_MAGIC, LZ42_MAGIC, LZ4_LEG_MAGIC,
+                              ZSTD_MAGIC, MTK_MAGIC, DTB_MAGIC, DHTB_MAGIC, TEGRABLOB_MAGIC})
+            add(m[0], m[1]);
+        // LZMA: 0x5d followed by the low byte of a power-of-two dictionary size
+        add(0x5d, 0);
+        for (int i = 0; i < 8; ++i)
+            add(0x5d, 1 << i);
+        return t;
+    }();
+    unsigned i = p[0] << 8 | p[1];
+    return (table[i >> 6] >> (i & 63)) & 1;
+}
+
+// find_fmt: first address in [p, end) where check_fmt recognises a format, or nullptr.
+static const uint8_t *find_fmt(const uint8_t *p, const uint8_t *end) {
+    for (; end - p >= 2; ++p) {
+        bool zimage = end - p >= 0x28 && BUFFER_MATCH(p + 0x24, ZIMAGE_MAGIC);
+        if ((zimage || fmt_lead_pair(p)) && check_fmt(p, end - p) != FileFormat::UNKNOWN)
+            return p;
+    }
+    return nullptr;
+}
+
 #define CMD_MATCH(s) BUFFER_MATCH((h)->cmdline.data(), (s))
 
 const uint8_t *boot_img::parse_hdr(const uint8_t *addr, FileFormat type) {
@@ -389,13 +535,9 @@ const uint8_t *boot_img::parse_hdr(const uint8_t *addr, FileFormat type) {
 void boot_img::parse_zimage() {
     z_info.hdr = reinterpret_cast<const zimage_hdr *>(kernel);
 
-    const uint8_t *piggy = nullptr;
-    for (const uint8_t *curr = kernel + 0x28; curr < kernel + hdr->kernel_size(); curr++) {
-        if (check_fmt_lg(curr, hdr->kernel_size() - (curr - kernel)) != FileFormat::UNKNOWN) {
-            piggy = curr;
-            break;
-        }
-    }
+    // check_fmt_lg only differs from check_fmt in which LZ4 legacy variant it reports, so
+    // the search uses the cheap check and the chain is walked once for k_fmt below
+    const uint8_t *piggy = hdr->kernel_size() > 0x28 ? find_fmt(kernel + 0x28, kernel + hdr->kernel_size()) : nullptr;
 
     if (piggy != nullptr) {
         fprintf(stderr, "ZIMAGE_KERNEL\n");
@@ -586,26 +728,37 @@ bool boot_img::parse_image(const uint8_t *addr, FileFormat type) {
     return true;
 }
 
-int split_image_dtb(Utf8CStr filename, bool skip_decomp) {
+int split_image_dtb(Utf8CStr filename, bool skip_decomp, bool all) {
     mmap_data img(filename.c_str());
 
-    if (int offset = find_dtb_offset(img.data(), img.size()); offset > 0) {
-        size_t off = (size_t) offset;
-
-        FileFormat fmt = check_fmt_lg(img.data(), img.size());
-        if (!skip_decomp && fmt_compressed(fmt)) {
-            int fd = creat(KERNEL_FILE, 0644);
-            decompress(fmt, fd, img.data(), off);
-            close(fd);
-        } else {
-            dump(img.data(), off, KERNEL_FILE);
-        }
-        dump(img.data() + off, img.size() - off, KER_DTB_FILE);
-        return 0;
-    } else {
+    auto dtbs = find_dtbs(byte_view(img.data(), img.size()));
+    if (dtbs.empty() || dtbs[0].data() == img.data()) {
         fprintf(stderr, "Cannot find DTB in %s\n", filename.c_str());
         return 1;
     }
+    size_t off = dtbs[0].data() - img.data();
+    fprintf(stderr, "%-*s [%zu]\n", PADDING, "KERNEL_DTB_CNT", dtbs.size());
+
+    // kernel, kernel_dtb and (with all) kernel_dtb.<n> are independent files
+    parallel_for(2 + (all ? dtbs.size() : 0), [&](size_t i) {
+        if (i == 0) {
+            FileFormat fmt = check_fmt_lg(img.data(), img.size());
+            if (!skip_decomp && fmt_compressed(fmt)) {
+                int fd = creat(KERNEL_FILE, 0644);
+                decompress(fmt, fd, img.data(), off);
+                close(fd);
+            } else {
+                dump(img.data(), off, KERNEL_FILE);
+            }
+        } else if (i == 1) {
+            dump(img.data() + off, img.size() - off, KER_DTB_FILE);
+        } else {
+            char name[64];
+            ssprintf(name, sizeof(name), KER_DTB_FILE ".%zu", i - 2);
+            dump(dtbs[i - 2].data(), dtbs[i - 2].size(), name);
+        }
+    });
+    return 0;
 }
 
 int unpack(Utf8CStr image, bool skip_decomp, bool hdr) {
@@ -614,21 +767,35 @@ int unpack(Utf8CStr image, bool skip_decomp, bool hdr) {
     if (hdr)
         boot.hdr->dump_hdr_file();
 
+    // Compressed components are decompressed concurrently once all are known, largest first;
+    // each writes its own file and records its signature in its own slot
+    struct decomp_task {
+        FileFormat fmt;
+        byte_view src;
+        int dirfd;
+        string file;
+        string sig_name;
+        string sig;
+    };
+    vector<decomp_task> tasks;
+    auto decompress_to = [&](FileFormat fmt, byte_view src, int dirfd, string file, string sig_name) {
+        tasks.push_back({fmt, src, dirfd, std::move(file), std::move(sig_name), {}});
+    };
+
     if (!skip_decomp && fmt_compressed(boot.k_fmt)) {
-        if (boot.hdr->kernel_size() != 0) {
-            int fd = creat(KERNEL_FILE, 0644);
-            decompress(boot.k_fmt, fd, boot.kernel, boot.hdr->kernel_size());
-            close(fd);
-        }
+        if (boot.hdr->kernel_size() != 0)
+            decompress_to(boot.k_fmt, byte_view(boot.kernel, boot.hdr->kernel_size()), AT_FDCWD,
+                          KERNEL_FILE, KERNEL_FILE);
     } else {
         dump(boot.kernel, boot.hdr->kernel_size(), KERNEL_FILE);
     }
 
     dump(boot.kernel_dtb.data(), boot.kernel_dtb.size(), KER_DTB_FILE);
 
+    owned_fd dirfd;
     if (boot.hdr->vendor_ramdisk_table_size()) {
         xmkdir(VND_RAMDISK_DIR, 0755);
-        owned_fd dirfd = owned_fd(xopen(VND_RAMDISK_DIR, O_RDONLY | O_CLOEXEC));
+        dirfd = owned_fd(xopen(VND_RAMDISK_DIR, O_RDONLY | O_CLOEXEC));
         for (auto &it : boot.vendor_ramdisk_tbl()) {
             char file_name[40];
             if (it.ramdisk_name[0] == '\0') {
@@ -636,20 +803,19 @@ int unpack(Utf8CStr image, bool skip_decomp, bool hdr) {
             } else {
                 ssprintf(file_name, sizeof(file_name), "%.*s.cpio", static_cast<int>(it.ramdisk_name.size()), it.ramdisk_name.data());
             }
-            owned_fd fd = owned_fd(xopenat(dirfd, file_name, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644));
             FileFormat fmt = check_fmt_lg(boot.ramdisk + it.ramdisk_offset, it.ramdisk_size);
             if (!skip_decomp && fmt_compressed(fmt)) {
-                decompress(fmt, fd, boot.ramdisk + it.ramdisk_offset, it.ramdisk_size);
+                decompress_to(fmt, byte_view(boot.ramdisk + it.ramdisk_offset, it.ramdisk_size), dirfd,
+                              file_name, string(VND_RAMDISK_DIR "/") + file_name);
             } else {
+                owned_fd fd = owned_fd(xopenat(dirfd, file_name, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644));
                 xwrite(fd, boot.ramdisk + it.ramdisk_offset, it.ramdisk_size);
             }
         }
     } else if (!skip_decomp && fmt_compressed(boot.r_fmt)) {
-        if (boot.hdr->ramdisk_size() != 0) {
-            int fd = creat(RAMDISK_FILE, 0644);
-            decompress(boot.r_fmt, fd, boot.ramdisk, boot.hdr->ramdisk_size());
-            close(fd);
-        }
+        if (boot.hdr->ramdisk_size() != 0)
+            decompress_to(boot.r_fmt, byte_view(boot.ramdisk, boot.hdr->ramdisk_size()), AT_FDCWD,
+                          RAMDISK_FILE, RAMDISK_FILE);
     } else {
         dump(boot.ramdisk, boot.hdr->ramdisk_size(), RAMDISK_FILE);
     }
@@ -657,11 +823,9 @@ int unpack(Utf8CStr image, bool skip_decomp, bool hdr) {
     dump(boot.second, boot.hdr->second_size(), SECOND_FILE);
 
     if (!skip_decomp && fmt_compressed(boot.e_fmt)) {
-        if (boot.hdr->extra_size() != 0) {
-            int fd = creat(EXTRA_FILE, 0644);
-            decompress(boot.e_fmt, fd, boot.extra, boot.hdr->extra_size());
-            close(fd);
-        }
+        if (boot.hdr->extra_size() != 0)
+            decompress_to(boot.e_fmt, byte_view(boot.extra, boot.hdr->extra_size()), AT_FDCWD,
+                          EXTRA_FILE, EXTRA_FILE);
     } else {
         dump(boot.extra, boot.hdr->extra_size(), EXTRA_FILE);
     }
@@ -670,18 +834,178 @@ int unpack(Utf8CStr image, bool skip_decomp, bool hdr) {
     dump(boot.dtb, boot.hdr->dtb_size(), DTB_FILE);
     dump(boot.bootconfig, boot.hdr->bootconfig_size(), BOOTCONFIG_FILE);
 
+    stable_sort(tasks.begin(), tasks.end(), [](const decomp_task &a, const decomp_task &b) {
+        return a.src.size() > b.src.size();
+    });
+    parallel_for(tasks.size(), [&](size_t i) {
+        auto &t = tasks[i];
+        owned_fd fd(xopenat(t.dirfd, t.file.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644));
+        decompress_bytes(t.fmt, t.src, fd);
+        t.sig = content_sig(t.src, mmap_data(t.dirfd, t.file.c_str()));
+    });
+
+    map<string, string> sigs;
+    for (auto &t : tasks)
+        sigs[t.sig_name] = t.sig;
+    dump_hash_file(sigs);
+
     if (boot.flags[CHROMEOS_FLAG]) return RETURN_CHROMEOS;
     if (boot.hdr->is_vendor()) return RETURN_VENDOR;
     return RETURN_OK;
 }
 
-#define file_align_with(page_size) \
-write_zero(fd, align_padding(lseek(fd, 0, SEEK_CUR) - off.header, page_size))
+// The output image as an ordered list of byte runs. Repack lays everything out first so
+// sizes, offsets and digests are known before the first write, then writes each byte once.
+struct image_plan {
+    struct piece {
+        const uint8_t *data;  // nullptr for a run of zeros
+        size_t size;
+        int fd;               // file holding the bytes at file_off, or -1
+        off_t file_off;
+    };
+    struct source {
+        const uint8_t *base;
+        size_t size;
+        int fd;
+    };
+    vector<piece> pieces;
+    vector<source> sources;
+    size_t size = 0;
+
+    // Pieces added later from within map, a mapping of the whole of fd, are copied from fd
+    void add_source(byte_view map, int fd) {
+        if (map.data() && fd >= 0)
+            sources.push_back({map.data(), map.size(), fd});
+    }
+    size_t add(const void *data, size_t len) {
+        if (len) {
+            piece p{static_cast<const uint8_t *>(data), len, -1, 0};
+            for (auto &s : sources) {
+                if (p.data && p.data >= s.base && p.data + len <= s.base + s.size) {
+                    p.fd = s.fd;
+                    p.file_off = p.data - s.base;
+                    break;
+                }
+            }
+            pieces.push_back(p);
+        }
+        size += len;
+        return len;
+    }
+    size_t add(byte_view v) { return add(v.data(), v.size()); }
+    void zeros(size_t len) { add(nullptr, len); }
+    // Pad with zeros so that size - base is a multiple of page
+    void align(size_t base, size_t page) { zeros(align_padding(size - base, page)); }
+
+    // Calls fn on the bytes of [off, off + len), in order
+    template <typename Fn>
+    void visit(size_t off, size_t len, Fn &&fn) const {
+        size_t pos = 0;
+        for (auto &p : pieces) {
+            if (len == 0)
+                break;
+            if (pos + p.size > off) {
+                size_t start = off - pos;
+                size_t n = min(p.size - start, len);
+                visit_piece(p, start, n, fn);
+                off += n;
+                len -= n;
+            }
+            pos += p.size;
+        }
+    }
+
+    // Writes the image to fd. Bytes in [tee_off, tee_off + tee_len) are also fed to tee just
+    // before they are written. Pieces backed by a file are copied from it with xcopy_range, so
+    // their bytes stay in the kernel (or share extents); runs of other pieces go out together
+    // with writev. Returns the number of bytes fed to tee.
+    size_t write(int fd, SHA *tee = nullptr, size_t tee_off = 0, size_t tee_len = 0) const {
+        // A regular file gets its final size up front, and the bytes around long zero runs are
+        // reserved with fallocate. The zero runs are then skipped and stay holes; anything else
+        // (e.g. a block device) has every byte written
+        struct stat st{};
+        const bool sparse = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && lseek(fd, 0, SEEK_CUR) == 0 &&
+                            ftruncate(fd, static_cast<off_t>(size)) == 0;
+        auto is_hole = [&](const piece &p) { return sparse && p.data == nullptr && p.size >= SPARSE_MIN; };
+#if defined(__linux__)
+        if (sparse) {
+            size_t run = 0, end = 0;
+            for (auto &p : pieces) {
+                if (is_hole(p)) {
+                    if (end > run)
+                        fallocate(fd, 0, run, end - run);
+                    run = end + p.size;
+                }
+                end += p.size;
+            }
+            if (end > run)
+                fallocate(fd, 0, run, end - run);
+        }
+#endif
+
+        size_t pos = 0, teed = 0;
+        vector<iovec> iov;
+        auto flush = [&] {
+            xwritev_all(fd, iov.data(), iov.size());
+            iov.clear();
+        };
+        for (auto &p : pieces) {
+            if (tee) {
+                size_t lo = max(pos, tee_off);
+                size_t hi = min(pos + p.size, tee_off + tee_len);
+                if (lo < hi) {
+                    visit_piece(p, lo - pos, hi - lo, [&](byte_view v) { tee->update(v); });
+                    teed += hi - lo;
+                }
+            }
+            if (is_hole(p)) {
+                flush();
+                lseek(fd, p.size, SEEK_CUR);
+            } else if (p.fd >= 0) {
+                flush();
+                size_t done = xcopy_range(fd, p.fd, p.file_off, p.size);
+                if (done < p.size)
+                    xwrite(fd, p.data + done, p.size - done);
+            } else {
+                visit_piece(p, 0, p.size, [&](byte_view v) {
+                    iov.push_back({const_cast<uint8_t *>(v.data()), v.size()});
+                });
+            }
+            pos += p.size;
+        }
+        flush();
+        return teed;
+    }
+
+private:
+    // Zero runs at least this long are left as holes in regular files
+    static constexpr size_t SPARSE_MIN = 65536;
 
-#define file_align() file_align_with(boot.hdr->page_size())
+    template <typename Fn>
+    static void visit_piece(const piece &p, size_t start, size_t len, Fn &&fn) {
+        static const uint8_t zero_buf[65536] = {};
+        if (p.data) {
+            fn(byte_view(p.data + start, len));
+            return;
+        }
+        while (len) {
+            size_t n = min(len, sizeof(zero_buf));
+            fn(byte_view(zero_buf, n));
+            len -= n;
+        }
+    }
+};
 
-void repack(Utf8CStr src_img, Utf8CStr out_img, bool skip_comp) {
-    const boot_img boot(src_img.c_str());
+// In-memory input of patch: every component is taken unchanged from the source image,
+// except the ramdisk, which is replaced by the uncompressed archive in ramdisk if set.
+struct patch_input {
+    const mmap_data *ramdisk = nullptr;
+    size_t entry = 0;  // vendor ramdisk table entry that ramdisk replaces
+};
+
+// Without patch, components are read from the files unpack left in the current directory
+static int repack_image(const boot_img &boot, const Utf8CStr &src_img, const Utf8CStr &out_img,
+                         bool skip_comp, const patch_input *patch) {
     fprintf(stderr, "Repack to boot image: [%s]\n", out_img.c_str());
 
     struct {
@@ -702,282 +1026,369 @@ void repack(Utf8CStr src_img, Utf8CStr out_img, bool skip_comp) {
     hdr->set_dtb_size(0);
     hdr->set_bootconfig_size(0);
 
-    if (access(HEADER_FILE, R_OK) == 0)
+    if (!patch && access(HEADER_FILE, R_OK) == 0)
         hdr->load_hdr_file();
 
-    int fd = open(out_img.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    const size_t page_size = boot.hdr->page_size();
+    image_plan plan;
+    owned_fd src_fd(xopen(src_img.c_str(), O_RDONLY | O_CLOEXEC));
+    plan.add_source(byte_view(boot.map.data(), boot.map.size()), src_fd);
+
+    // Storage backing the plan; lists so that nothing moves once added
+    list<mmap_data> maps;
+    list<owned_fd> fds;
+    // Maps an unpacked file; the plan copies it from an fd of its own rather than the mapping
+    auto map_file = [&](int dirfd, const char *name) -> const mmap_data & {
+        auto &m = maps.emplace_back(dirfd, name);
+        plan.add_source(byte_view(m.data(), m.size()), fds.emplace_back(openat(dirfd, name, O_RDONLY | O_CLOEXEC)));
+        return m;
+    };
+    list<vector<uint8_t>> bufs;
+    auto copy_of = [&](const void *data, size_t len) -> vector<uint8_t> & {
+        auto p = static_cast<const uint8_t *>(data);
+        return bufs.emplace_back(p, p + len);
+    };
+    // A component taken as is: its unpacked file, or with patch its bytes in the source image
+    auto has = [&](const char *name, byte_view src) {
+        return patch ? src.size() != 0 : access(name, R_OK) == 0;
+    };
+    auto restore = [&](const char *name, byte_view src) -> size_t {
+        if (patch)
+            return plan.add(src);
+        auto &m = map_file(AT_FDCWD, name);
+        return plan.add(m.data(), m.size());
+    };
+
+    // Components whose unpacked file is unchanged are copied from the source image
+    const auto sigs = patch ? map<string, string>() : load_hash_file();
+    auto unchanged = [&](const char *name, FileFormat fmt, byte_view src, const byte_data &file) -> bool {
+        auto it = sigs.find(name);
+        if (it == sigs.end() || it->second != content_sig(src, file))
+            return false;
+        fprintf(stderr, "%s: unchanged, reusing original [%s]\n", name, fmt2name(fmt));
+        return true;
+    };
+
+    // Kernel, ramdisks and extra are resolved before the layout: each is its unpacked file as
+    // is, the original bytes (unchanged since unpack), or the file to compress. Everything to
+    // compress is then compressed concurrently, so the layout waits for the slowest codec only.
+    struct component {
+        byte_view data;
+        FileFormat fmt = FileFormat::UNKNOWN;  // compress data with fmt into out
+        byte_view out;
+        byte_view bytes() const { return fmt == FileFormat::UNKNOWN ? data : out; }
+    };
+    auto prepare = [&](component &c, const char *name, byte_view src, FileFormat src_fmt, FileFormat fmt,
+                       bool reusable, const byte_data &file) {
+        c.data = byte_view(file.data(), file.size());
+        if (skip_comp || fmt_compressed_any(check_fmt(file.data(), file.size())) || !fmt_compressed(fmt))
+            return;
+        if (reusable && unchanged(name, src_fmt, src, file)) {
+            c.data = src;
+        } else {
+            c.fmt = fmt;
+        }
+    };
+
+    component kernel;
+    const bool kernel_file = !patch && access(KERNEL_FILE, R_OK) == 0;
+    if (kernel_file) {
+        auto &m = map_file(AT_FDCWD, KERNEL_FILE);
+        auto fmt = (boot.flags[ZIMAGE_KERNEL] && boot.k_fmt == FileFormat::GZIP) ? FileFormat::ZOPFLI : boot.k_fmt;
+        prepare(kernel, KERNEL_FILE, byte_view(boot.kernel, boot.hdr->kernel_size()), boot.k_fmt, fmt, true, m);
+    }
+
+    // One per vendor ramdisk table entry, else the ramdisk (if any)
+    vector<component> ramdisks;
+    vector<vendor_ramdisk_table_entry_v4> ramdisk_table;
+    const FileFormat target_fmt = ramdisk_fmt_override();
+    if (boot.hdr->vendor_ramdisk_table_size()) {
+        auto tbl = boot.vendor_ramdisk_tbl();
+        ramdisk_table.assign(tbl.begin(), tbl.end());
+        ramdisks.resize(ramdisk_table.size());
+
+        owned_fd dirfd = owned_fd(patch ? -1 : xopen(VND_RAMDISK_DIR, O_RDONLY | O_CLOEXEC));
+        for (size_t i = 0; i < ramdisk_table.size(); ++i) {
+            auto &it = ramdisk_table[i];
+            auto &c = ramdisks[i];
+            byte_view src(boot.ramdisk + it.ramdisk_offset, it.ramdisk_size);
+            if (patch && (!patch->ramdisk || i != patch->entry)) {
+                c.data = src;
+                continue;
+            }
+            char file_name[64];
+            if (it.ramdisk_name[0] == '\0') {
+                strscpy(file_name, RAMDISK_FILE, sizeof(file_name));
+            } else {
+                ssprintf(file_name, sizeof(file_name), "%.*s.cpio", static_cast<int>(it.ramdisk_name.size()), it.ramdisk_name.data());
+            }
+            const mmap_data &m = patch ? *patch->ramdisk : map_file(dirfd, file_name);
+            const FileFormat src_fmt = check_fmt_lg(src.data(), src.size());
+            FileFormat fmt = src_fmt;
+            if (!skip_comp && target_fmt != FileFormat::UNKNOWN && fmt != target_fmt) {
+                fprintf(stderr, "%s: [%s] -> [%s]\n", file_name, fmt2name(fmt), fmt2name(target_fmt));
+                fmt = target_fmt;
+            }
+            const string name = string(VND_RAMDISK_DIR "/") + file_name;
+            prepare(c, name.c_str(), src, src_fmt, fmt, fmt == src_fmt, m);
+        }
+    } else if (patch && !patch->ramdisk) {
+        if (boot.hdr->ramdisk_size() != 0)
+            ramdisks.push_back({byte_view(boot.ramdisk, boot.hdr->ramdisk_size())});
+    } else if (patch || access(RAMDISK_FILE, R_OK) == 0) {
+        const mmap_data &m = patch ? *patch->ramdisk : map_file(AT_FDCWD, RAMDISK_FILE);
+        if (!m.data() && m.size() == 0) {
+            fprintf(stderr, "repack: RAMDISK_FILE mmap failed\n");
+            delete hdr;
+            return 1;
+        }
+        auto r_fmt = boot.r_fmt;
+        if (!skip_comp && target_fmt != FileFormat::UNKNOWN) {
+            if (r_fmt != target_fmt)
+                fprintf(stderr, "RAMDISK_FMT: [%s] -> [%s]\n", fmt2name(r_fmt), fmt2name(target_fmt));
+            r_fmt = target_fmt;
+        } else if (!skip_comp && !hdr->is_vendor() && hdr->header_version() == 4 && r_fmt != FileFormat::LZ4_LEGACY) {
+            fprintf(stderr, "RAMDISK_FMT: [%s] -> [%s]\n", fmt2name(r_fmt), fmt2name(FileFormat::LZ4_LEGACY));
+            r_fmt = FileFormat::LZ4_LEGACY;
+        }
+        prepare(ramdisks.emplace_back(), RAMDISK_FILE, byte_view(boot.ramdisk, boot.hdr->ramdisk_size()),
+                r_fmt, r_fmt, r_fmt == boot.r_fmt, m);
+    }
+
+    component extra;
+    bool has_extra = false;
+    if (patch && boot.hdr->extra_size() != 0) {
+        extra = {byte_view(boot.extra, boot.hdr->extra_size())};
+        has_extra = true;
+    } else if (!patch && access(EXTRA_FILE, R_OK) == 0) {
+        auto &m = map_file(AT_FDCWD, EXTRA_FILE);
+        prepare(extra, EXTRA_FILE, byte_view(boot.extra, boot.hdr->extra_size()), boot.e_fmt, boot.e_fmt, true, m);
+        has_extra = true;
+    }
+
+    vector<component *> pending;
+    for (auto *c : {&kernel, &extra})
+        if (c->fmt != FileFormat::UNKNOWN)
+            pending.push_back(c);
+    for (auto &c : ramdisks)
+        if (c.fmt != FileFormat::UNKNOWN)
+            pending.push_back(&c);
+    stable_sort(pending.begin(), pending.end(), [](const component *a, const component *b) {
+        return a->data.size() > b->data.size();
+    });
+    vector<unique_ptr<mmap_data>> outs(pending.size());
+    parallel_for(pending.size(), [&](size_t i) {
+        auto &c = *pending[i];
+        owned_fd mfd(xmemfd("magiskboot"));
+        compress_bytes(c.fmt, c.data, mfd);
+        size_t len = lseek(mfd, 0, SEEK_END);
+        if (len != 0) {
+            outs[i] = make_unique<mmap_data>(mfd, len);
+            c.out = byte_view(outs[i]->data(), outs[i]->size());
+        }
+    });
 
+    size_t pre_sz = 0;
     if (boot.flags[DHTB_FLAG]) {
-        xwrite(fd, boot.map.data(), sizeof(dhtb_hdr));
+        pre_sz = sizeof(dhtb_hdr);
     } else if (boot.flags[BLOB_FLAG]) {
-        xwrite(fd, boot.map.data(), sizeof(blob_hdr));
+        pre_sz = sizeof(blob_hdr);
     } else if (boot.flags[NOOKHD_FLAG]) {
-        xwrite(fd, boot.map.data(), NOOKHD_PRE_HEADER_SZ);
+        pre_sz = NOOKHD_PRE_HEADER_SZ;
     } else if (boot.flags[ACCLAIM_FLAG]) {
-        xwrite(fd, boot.map.data(), ACCLAIM_PRE_HEADER_SZ);
+        pre_sz = ACCLAIM_PRE_HEADER_SZ;
     }
+    auto &pre = copy_of(boot.map.data(), pre_sz);
+    plan.add(pre.data(), pre.size());
 
-    // Copy raw header
-    off.header = lseek(fd, 0, SEEK_CUR);
-    xwrite(fd, boot.payload.data(), hdr->hdr_space());
+    // Copy raw header; the final header is copied over it once sizes and the id are known
+    off.header = plan.size;
+    auto &hdr_buf = copy_of(boot.payload.data(), hdr->hdr_space());
+    plan.add(hdr_buf.data(), hdr_buf.size());
 
-    off.kernel = lseek(fd, 0, SEEK_CUR);
+    off.kernel = plan.size;
+    mtk_hdr k_mtk{};
     if (boot.flags[MTK_KERNEL]) {
-        xwrite(fd, boot.k_hdr, sizeof(mtk_hdr));
+        memcpy(&k_mtk, boot.k_hdr, sizeof(k_mtk));
+        plan.add(&k_mtk, sizeof(k_mtk));
     }
     if (boot.flags[ZIMAGE_KERNEL]) {
-        xwrite(fd, boot.z_info.hdr, boot.z_info.hdr_sz);
+        plan.add(boot.z_info.hdr, boot.z_info.hdr_sz);
     }
-    if (access(KERNEL_FILE, R_OK) == 0) {
-        mmap_data m(KERNEL_FILE);
-        if (!skip_comp && !fmt_compressed_any(check_fmt(m.data(), m.size())) && fmt_compressed(boot.k_fmt)) {
-            auto fmt = (boot.flags[ZIMAGE_KERNEL] && boot.k_fmt == FileFormat::GZIP) ? FileFormat::ZOPFLI : boot.k_fmt;
-            hdr->set_kernel_size(compress_len(fmt, byte_view(m.data(), m.size()), fd));
-        } else {
-            hdr->set_kernel_size(xwrite(fd, m.data(), m.size()));
-        }
-
+    uint32_t z_size = 0;
+    if (kernel_file) {
+        const byte_view k = kernel.bytes();
         if (boot.flags[ZIMAGE_KERNEL]) {
-            if (hdr->kernel_size() > boot.hdr->kernel_size()) {
+            // Unless reused or --skip-comp, the piggy is padded back to the original size with
+            // the size of the kernel file in the last 4 bytes; it always fills the original size
+            size_t limit = boot.hdr->kernel_size();
+            const bool trailer = !skip_comp && k.data() != boot.kernel;
+            if (k.size() > limit || (trailer && k.size() + sizeof(z_size) > limit)) {
                 fprintf(stderr, "! Recompressed kernel is too large, using original kernel\n");
-                off_t pos = lseek(fd, -static_cast<off_t>(hdr->kernel_size()), SEEK_CUR);
-                ftruncate(fd, pos);
-                xwrite(fd, boot.kernel, boot.hdr->kernel_size());
-            } else if (!skip_comp) {
-                uint32_t sz = m.size();
-                write_zero(fd, boot.hdr->kernel_size() - hdr->kernel_size() - sizeof(sz));
-                xwrite(fd, &sz, sizeof(sz));
+                plan.add(boot.kernel, limit);
+            } else if (trailer) {
+                plan.add(k);
+                z_size = kernel.data.size();
+                plan.zeros(limit - k.size() - sizeof(z_size));
+                plan.add(&z_size, sizeof(z_size));
+            } else {
+                plan.add(k);
+                plan.zeros(limit - k.size());
             }
-
-            hdr->set_kernel_size(boot.hdr->kernel_size());
+            hdr->set_kernel_size(limit);
+        } else {
+            hdr->set_kernel_size(plan.add(k));
         }
     } else if (boot.hdr->kernel_size() != 0) {
-        xwrite(fd, boot.kernel, boot.hdr->kernel_size());
+        plan.add(boot.kernel, boot.hdr->kernel_size());
         hdr->set_kernel_size(boot.hdr->kernel_size());
     }
     if (boot.flags[ZIMAGE_KERNEL]) {
         hdr->set_kernel_size(hdr->kernel_size() + boot.z_info.hdr_sz);
-        hdr->set_kernel_size(hdr->kernel_size() + xwrite(fd, boot.z_info.tail.data(), boot.z_info.tail.size()));
+        hdr->set_kernel_size(hdr->kernel_size() + plan.add(boot.z_info.tail));
     }
 
-    if (access(KER_DTB_FILE, R_OK) == 0)
-        hdr->set_kernel_size(hdr->kernel_size() + restore(fd, KER_DTB_FILE));
-    file_align();
+    if (has(KER_DTB_FILE, boot.kernel_dtb))
+        hdr->set_kernel_size(hdr->kernel_size() + restore(KER_DTB_FILE, boot.kernel_dtb));
+    if (boot.flags[MTK_KERNEL]) {
+        k_mtk.size = hdr->kernel_size();
+        hdr->set_kernel_size(hdr->kernel_size() + sizeof(mtk_hdr));
+    }
+    plan.align(off.header, page_size);
 
-    off.ramdisk = lseek(fd, 0, SEEK_CUR);
+    off.ramdisk = plan.size;
+    mtk_hdr r_mtk{};
     if (boot.flags[MTK_RAMDISK]) {
-        xwrite(fd, boot.r_hdr, sizeof(mtk_hdr));
+        memcpy(&r_mtk, boot.r_hdr, sizeof(r_mtk));
+        plan.add(&r_mtk, sizeof(r_mtk));
     }
 
-    vector<vendor_ramdisk_table_entry_v4> ramdisk_table;
-
     if (boot.hdr->vendor_ramdisk_table_size()) {
-        auto tbl = boot.vendor_ramdisk_tbl();
-        ramdisk_table.assign(tbl.begin(), tbl.end());
-
-        owned_fd dirfd = owned_fd(xopen(VND_RAMDISK_DIR, O_RDONLY | O_CLOEXEC));
         uint32_t ramdisk_offset = 0;
-        for (auto &it : ramdisk_table) {
-            char file_name[64];
-            if (it.ramdisk_name[0] == '\0') {
-                strscpy(file_name, RAMDISK_FILE, sizeof(file_name));
-            } else {
-                ssprintf(file_name, sizeof(file_name), "%.*s.cpio", static_cast<int>(it.ramdisk_name.size()), it.ramdisk_name.data());
-            }
-            mmap_data m(dirfd, file_name);
-            FileFormat fmt = check_fmt_lg(boot.ramdisk + it.ramdisk_offset, it.ramdisk_size);
+        for (size_t i = 0; i < ramdisk_table.size(); ++i) {
+            auto &it = ramdisk_table[i];
             it.ramdisk_offset = ramdisk_offset;
-            if (!skip_comp && !fmt_compressed_any(check_fmt(m.data(), m.size())) && fmt_compressed(fmt)) {
-                it.ramdisk_size = compress_len(fmt, byte_view(m.data(), m.size()), fd);
-            } else {
-                it.ramdisk_size = xwrite(fd, m.data(), m.size());
-            }
+            it.ramdisk_size = plan.add(ramdisks[i].bytes());
             ramdisk_offset += it.ramdisk_size;
         }
-
         hdr->set_ramdisk_size(ramdisk_offset);
-        file_align();
-    } else if (access(RAMDISK_FILE, R_OK) == 0) {
-        mmap_data m(RAMDISK_FILE);
-        if (!m.data() && m.size() == 0) {
-            fprintf(stderr, "repack: RAMDISK_FILE mmap failed\n");
-            delete hdr;
-            close(fd);
-            return;
-        }
-        auto r_fmt = boot.r_fmt;
-        if (!skip_comp && !hdr->is_vendor() && hdr->header_version() == 4 && r_fmt != FileFormat::LZ4_LEGACY) {
-            fprintf(stderr, "RAMDISK_FMT: [%s] -> [%s]\n", fmt2name(r_fmt), fmt2name(FileFormat::LZ4_LEGACY));
-            r_fmt = FileFormat::LZ4_LEGACY;
-        }
-        if (!skip_comp && !fmt_compressed_any(check_fmt(m.data(), m.size())) && fmt_compressed(r_fmt)) {
-            hdr->set_ramdisk_size(compress_len(r_fmt, byte_view(m.data(), m.size()), fd));
-        } else {
-            hdr->set_ramdisk_size(xwrite(fd, m.data(), m.size()));
-        }
-        file_align();
+        plan.align(off.header, page_size);
+    } else if (!ramdisks.empty()) {
+        hdr->set_ramdisk_size(plan.add(ramdisks[0].bytes()));
+        plan.align(off.header, page_size);
+    }
+    if (boot.flags[MTK_RAMDISK]) {
+        r_mtk.size = hdr->ramdisk_size();
+        hdr->set_ramdisk_size(hdr->ramdisk_size() + sizeof(mtk_hdr));
     }
 
-    off.second = lseek(fd, 0, SEEK_CUR);
-    if (access(SECOND_FILE, R_OK) == 0) {
-        hdr->set_second_size(restore(fd, SECOND_FILE));
-        file_align();
+    off.second = plan.size;
+    if (byte_view src(boot.second, boot.hdr->second_size()); has(SECOND_FILE, src)) {
+        hdr->set_second_size(restore(SECOND_FILE, src));
+        plan.align(off.header, page_size);
     }
 
-    off.extra = lseek(fd, 0, SEEK_CUR);
-    if (access(EXTRA_FILE, R_OK) == 0) {
-        mmap_data m(EXTRA_FILE);
-        if (!skip_comp && !fmt_compressed_any(check_fmt(m.data(), m.size())) && fmt_compressed(boot.e_fmt)) {
-            hdr->set_extra_size(compress_len(boot.e_fmt, byte_view(m.data(), m.size()), fd));
-        } else {
-            hdr->set_extra_size(xwrite(fd, m.data(), m.size()));
-        }
-        file_align();
+    off.extra = plan.size;
+    if (has_extra) {
+        hdr->set_extra_size(plan.add(extra.bytes()));
+        plan.align(off.header, page_size);
+    } else {
+        hdr->set_extra_size(0);
     }
 
-    if (access(RECV_DTBO_FILE, R_OK) == 0) {
-        hdr->set_recovery_dtbo_offset(lseek(fd, 0, SEEK_CUR));
-        hdr->set_recovery_dtbo_size(restore(fd, RECV_DTBO_FILE));
-        file_align();
+    if (byte_view src(boot.recovery_dtbo, boot.hdr->recovery_dtbo_size()); has(RECV_DTBO_FILE, src)) {
+        hdr->set_recovery_dtbo_offset(plan.size);
+        hdr->set_recovery_dtbo_size(restore(RECV_DTBO_FILE, src));
+        plan.align(off.header, page_size);
+    } else {
+        hdr->set_recovery_dtbo_offset(0);
+        hdr->set_recovery_dtbo_size(0);
     }
 
-    off.dtb = lseek(fd, 0, SEEK_CUR);
-    if (access(DTB_FILE, R_OK) == 0) {
-        hdr->set_dtb_size(restore(fd, DTB_FILE));
-        file_align();
+    off.dtb = plan.size;
+    if (byte_view src(boot.dtb, boot.hdr->dtb_size()); has(DTB_FILE, src)) {
+        hdr->set_dtb_size(restore(DTB_FILE, src));
+        plan.align(off.header, page_size);
     }
 
     if (boot.hdr->signature_size()) {
-        xwrite(fd, boot.signature, boot.hdr->signature_size());
-        file_align();
+        plan.add(boot.signature, boot.hdr->signature_size());
+        plan.align(off.header, page_size);
     }
 
     if (!ramdisk_table.empty()) {
-        xwrite(fd, ramdisk_table.data(), sizeof(*ramdisk_table.data()) * ramdisk_table.size());
-        file_align();
+        plan.add(ramdisk_table.data(), sizeof(*ramdisk_table.data()) * ramdisk_table.size());
+        plan.align(off.header, page_size);
     }
 
-    if (access(BOOTCONFIG_FILE, R_OK) == 0) {
-        hdr->set_bootconfig_size(restore(fd, BOOTCONFIG_FILE));
-        file_align();
+    if (byte_view src(boot.bootconfig, boot.hdr->bootconfig_size()); has(BOOTCONFIG_FILE, src)) {
+        hdr->set_bootconfig_size(restore(BOOTCONFIG_FILE, src));
+        plan.align(off.header, page_size);
     }
 
     if (boot.flags[SEANDROID_FLAG]) {
-        xwrite(fd, SEANDROID_MAGIC, 16);
+        plan.add(SEANDROID_MAGIC, 16);
         if (boot.flags[DHTB_FLAG]) {
-            xwrite(fd, "\xFF\xFF\xFF\xFF", 4);
+            plan.add("\xFF\xFF\xFF\xFF", 4);
         }
     } else if (boot.flags[LG_BUMP_FLAG]) {
-        xwrite(fd, LG_BUMP_MAGIC, 16);
+        plan.add(LG_BUMP_MAGIC, 16);
     }
 
-    off.tail = lseek(fd, 0, SEEK_CUR);
-    file_align();
+    off.tail = plan.size;
+    plan.align(off.header, page_size);
 
     // vbmeta
     if (boot.flags[AVB_FLAG]) {
         // According to avbtool.py, if the input is not an Android sparse image
         // (which boot images are not), the default block size is 4096
-        file_align_with(4096);
-        off.vbmeta = lseek(fd, 0, SEEK_CUR);
-        uint64_t vbmeta_size = __builtin_bswap64(boot.avb_footer->vbmeta_size);
-        xwrite(fd, boot.vbmeta, static_cast<size_t>(vbmeta_size));
+        plan.align(off.header, 4096);
+        off.vbmeta = plan.size;
+        size_t vbmeta_size = __builtin_bswap64(boot.avb_footer->vbmeta_size);
+        if (check_env("PATCHVBMETAFLAG") && vbmeta_size >= sizeof(AvbVBMetaImageHeader)) {
+            auto vbmeta = reinterpret_cast<const uint8_t *>(boot.vbmeta);
+            auto &patched = copy_of(vbmeta, sizeof(AvbVBMetaImageHeader));
+            reinterpret_cast<AvbVBMetaImageHeader *>(patched.data())->flags = __builtin_bswap32(3);
+            plan.add(patched.data(), patched.size());
+            plan.add(vbmeta + patched.size(), vbmeta_size - patched.size());
+        } else {
+            plan.add(boot.vbmeta, vbmeta_size);
+        }
     }
 
     // Pad image to original size if not chromeos (as it requires post processing)
-    if (!boot.flags[CHROMEOS_FLAG]) {
-        off_t current = lseek(fd, 0, SEEK_CUR);
-        if (current < static_cast<off_t>(boot.map.size())) {
-            write_zero(fd, boot.map.size() - current);
-        }
+    if (!boot.flags[CHROMEOS_FLAG] && plan.size < boot.map.size()) {
+        plan.zeros(boot.map.size() - plan.size);
     }
 
     uint32_t aosp_img_size = off.tail - off.header;
+    const size_t out_sz = plan.size;
 
-    off_t file_sz = lseek(fd, 0, SEEK_END);
-    if (file_sz <= 0) {
-        fprintf(stderr, "repack: output file size invalid (%lld)\n", static_cast<long long>(file_sz));
+    if (out_sz == 0) {
+        fprintf(stderr, "repack: output file size invalid (0)\n");
         delete hdr;
-        close(fd);
-        return;
-    }
-    const size_t out_sz = static_cast<size_t>(file_sz);
-
-    // Patch image using pread/pwrite only (no mmap) to avoid SIGSEGV on some devices (e.g. v4 + AVB).
-    if (boot.flags[MTK_KERNEL]) {
-        mtk_hdr m_hdr;
-        if (pread(fd, &m_hdr, sizeof(m_hdr), off.kernel) != static_cast<ssize_t>(sizeof(m_hdr))) {
-            fprintf(stderr, "repack: MTK kernel header read failed\n");
-            delete hdr;
-            close(fd);
-            return;
-        }
-        m_hdr.size = hdr->kernel_size();
-        if (pwrite(fd, &m_hdr, sizeof(m_hdr), off.kernel) != static_cast<ssize_t>(sizeof(m_hdr))) {
-            fprintf(stderr, "repack: MTK kernel header write failed\n");
-            delete hdr;
-            close(fd);
-            return;
-        }
-        hdr->set_kernel_size(hdr->kernel_size() + sizeof(mtk_hdr));
-    }
-    if (boot.flags[MTK_RAMDISK]) {
-        mtk_hdr m_hdr;
-        if (pread(fd, &m_hdr, sizeof(m_hdr), off.ramdisk) != static_cast<ssize_t>(sizeof(m_hdr))) {
-            fprintf(stderr, "repack: MTK ramdisk header read failed\n");
-            delete hdr;
-            close(fd);
-            return;
-        }
-        m_hdr.size = hdr->ramdisk_size();
-        if (pwrite(fd, &m_hdr, sizeof(m_hdr), off.ramdisk) != static_cast<ssize_t>(sizeof(m_hdr))) {
-            fprintf(stderr, "repack: MTK ramdisk header write failed\n");
-            delete hdr;
-            close(fd);
-            return;
-        }
-        hdr->set_ramdisk_size(hdr->ramdisk_size() + sizeof(mtk_hdr));
+        return 1;
     }
 
     hdr->set_header_size(hdr->hdr_size());
 
+    // The id is hashed from the planned sections, each followed by its size
     if (char *id = hdr->id()) {
         auto ctx = get_sha(!boot.flags[SHA256_FLAG]);
-        std::vector<char> buf;
-        auto read_update = [fd, &buf](uint32_t off_val, uint32_t len) -> byte_view {
-            if (len == 0) return byte_view(nullptr, 0);
-            buf.resize(len);
-            if (pread(fd, buf.data(), len, off_val) != static_cast<ssize_t>(len))
-                return byte_view(nullptr, 0);
-            return byte_view(buf.data(), len);
-        };
-        uint32_t size = hdr->kernel_size();
-        ctx->update(read_update(off.kernel, size));
-        ctx->update(byte_view(&size, sizeof(size)));
-        size = hdr->ramdisk_size();
-        ctx->update(read_update(off.ramdisk, size));
-        ctx->update(byte_view(&size, sizeof(size)));
-        size = hdr->second_size();
-        ctx->update(read_update(off.second, size));
-        ctx->update(byte_view(&size, sizeof(size)));
-        size = hdr->extra_size();
-        if (size) {
-            ctx->update(read_update(off.extra, size));
+        auto update = [&](uint32_t off_val, uint32_t size) {
+            plan.visit(off_val, size, [&](byte_view v) { ctx->update(v); });
             ctx->update(byte_view(&size, sizeof(size)));
-        }
+        };
+        update(off.kernel, hdr->kernel_size());
+        update(off.ramdisk, hdr->ramdisk_size());
+        update(off.second, hdr->second_size());
+        if (hdr->extra_size())
+            update(off.extra, hdr->extra_size());
         uint32_t ver = hdr->header_version();
-        if (ver == 1 || ver == 2) {
-            size = hdr->recovery_dtbo_size();
-            uint64_t ro_off = hdr->recovery_dtbo_offset();
-            if (ro_off <= out_sz && size <= out_sz - static_cast<size_t>(ro_off))
-                ctx->update(read_update(static_cast<uint32_t>(ro_off), size));
-            ctx->update(byte_view(&size, sizeof(size)));
-        }
-        if (ver == 2) {
-            size = hdr->dtb_size();
-            ctx->update(read_update(off.dtb, size));
-            ctx->update(byte_view(&size, sizeof(size)));
-        }
+        if (ver == 1 || ver == 2)
+            update(hdr->recovery_dtbo_offset(), hdr->recovery_dtbo_size());
+        if (ver == 2)
+            update(off.dtb, hdr->dtb_size());
         memset(id, 0, BOOT_ID_SIZE);
         ctx->finalize_into(byte_data(id, ctx->output_size()));
     }
@@ -987,18 +1398,35 @@ void repack(Utf8CStr src_img, Utf8CStr out_img, bool skip_comp) {
     const size_t hdr_copy_sz = boot.flags[AMONET_FLAG]
                                   ? min(hdr->hdr_space() - AMONET_MICROLOADER_SZ, hdr->hdr_size())
                                   : hdr->hdr_size();
-    const size_t hdr_off = boot.flags[AMONET_FLAG] ? off.header + AMONET_MICROLOADER_SZ : off.header;
-    if (hdr_off + hdr_copy_sz > out_sz || !hdr->raw_hdr()) {
+    const size_t hdr_off = boot.flags[AMONET_FLAG] ? AMONET_MICROLOADER_SZ : 0;
+    if (hdr_off + hdr_copy_sz > hdr_buf.size() || !hdr->raw_hdr()) {
         fprintf(stderr, "repack: header write out of bounds\n");
         delete hdr;
-        close(fd);
-        return;
+        return 1;
     }
-    if (pwrite(fd, hdr->raw_hdr(), hdr_copy_sz, hdr_off) != static_cast<ssize_t>(hdr_copy_sz)) {
-        fprintf(stderr, "repack: header write failed\n");
-        delete hdr;
-        close(fd);
-        return;
+    memcpy(hdr_buf.data() + hdr_off, hdr->raw_hdr(), hdr_copy_sz);
+
+    if (boot.flags[BLOB_FLAG]) {
+        reinterpret_cast<blob_hdr *>(pre.data())->size = aosp_img_size;
+    }
+
+    int fd = open(out_img.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    // DHTB checksums the AOSP image plus the 20 byte tail magic; it is hashed as it is written
+    if (boot.flags[DHTB_FLAG]) {
+        auto ctx = get_sha(false);
+        size_t dhtb_size = aosp_img_size + 16 + 4;
+        if (plan.write(fd, ctx.get(), off.header, dhtb_size) == dhtb_size) {
+            dhtb_hdr d_hdr;
+            memcpy(&d_hdr, pre.data(), sizeof(d_hdr));
+            d_hdr.size = dhtb_size;
+            ctx->finalize_into(byte_data(d_hdr.checksum.data(), SHA256_DIGEST_SIZE));
+            if (pwrite(fd, &d_hdr, sizeof(d_hdr), 0) != static_cast<ssize_t>(sizeof(d_hdr))) {
+                fprintf(stderr, "repack: DHTB header write failed\n");
+            }
+        }
+    } else {
+        plan.write(fd);
     }
 
     if (boot.flags[AVB_FLAG]) {
@@ -1006,7 +1434,7 @@ void repack(Utf8CStr src_img, Utf8CStr out_img, bool skip_comp) {
             fprintf(stderr, "repack: image too small for AVB footer\n");
             delete hdr;
             close(fd);
-            return;
+            return 1;
         }
         AvbFooter footer;
         memcpy(&footer, boot.avb_footer, sizeof(footer));
@@ -1018,53 +1446,107 @@ void repack(Utf8CStr src_img, Utf8CStr out_img, bool skip_comp) {
             fprintf(stderr, "repack: AVB footer write failed\n");
             delete hdr;
             close(fd);
-            return;
+            return 1;
         }
-        if (check_env("PATCHVBMETAFLAG")) {
-            AvbVBMetaImageHeader vbmeta;
-            if (pread(fd, &vbmeta, sizeof(vbmeta), off.vbmeta) == static_cast<ssize_t>(sizeof(vbmeta))) {
-                vbmeta.flags = __builtin_bswap32(3);
-                pwrite(fd, &vbmeta, sizeof(vbmeta), off.vbmeta);
-            }
+    }
+
+    if (boot.flags[AVB1_SIGNED_FLAG]) {
+        std::vector<char> payload_buf;
+        payload_buf.reserve(aosp_img_size);
+        plan.visit(off.header, aosp_img_size, [&](byte_view v) {
+            payload_buf.insert(payload_buf.end(), v.data(), v.data() + v.size());
+        });
+        auto sig = sign_payload(byte_view(payload_buf.data(), payload_buf.size()));
+        if (!sig.empty()) {
+            lseek(fd, off.tail, SEEK_SET);
+            xwrite(fd, sig.data(), sig.size());
         }
     }
 
-    if (boot.flags[DHTB_FLAG]) {
-        std::vector<char> dhtb_payload(aosp_img_size + 16 + 4);
-        ssize_t nr = pread(fd, dhtb_payload.data(), dhtb_payload.size(),
-                           static_cast<off_t>(sizeof(dhtb_hdr)));
-        if (nr == static_cast<ssize_t>(dhtb_payload.size())) {
-            dhtb_hdr d_hdr;
-            memcpy(&d_hdr, boot.map.data(), sizeof(d_hdr));
-            d_hdr.size = aosp_img_size + 16 + 4;
-            sha256_hash(byte_view(dhtb_payload.data(), d_hdr.size),
-                        byte_data(d_hdr.checksum.data(), SHA256_DIGEST_SIZE));
-            if (pwrite(fd, &d_hdr, sizeof(d_hdr), 0) != static_cast<ssize_t>(sizeof(d_hdr))) {
-                fprintf(stderr, "repack: DHTB header write failed\n");
-            }
+    // Logical size vs the blocks actually allocated: padding left as holes is not counted
+    if (struct stat st{}; fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%-*s [%zu]\n", PADDING, "OUTPUT_SZ", out_sz);
+        fprintf(stderr, "%-*s [%zu]\n", PADDING, "OUTPUT_ALLOC", static_cast<size_t>(st.st_blocks) * 512);
+    }
+
+    delete hdr;
+    close(fd);
+
+    // Refresh the hash descriptor; signed vbmeta is only touched when a key is given
+    if (boot.flags[AVB_FLAG]) {
+        const char *key = getenv("MAGISKBOOT_AVB_KEY");
+        int ret = 0;
+        if (key && *key)
+            ret = avb_sign(out_img.c_str(), key);
+        else if (boot.vbmeta->algorithm_type == 0)
+            ret = avb_sign(out_img.c_str(), nullptr);
+        // A stale or unsigned footer would not boot: leave no image behind
+        if (ret != 0) {
+            fprintf(stderr, "repack: AVB signing failed, removing [%s]\n", out_img.c_str());
+            unlink(out_img.c_str());
+            return 1;
         }
-    } else if (boot.flags[BLOB_FLAG]) {
-        blob_hdr b_hdr;
-        if (pread(fd, &b_hdr, sizeof(b_hdr), 0) == static_cast<ssize_t>(sizeof(b_hdr))) {
-            b_hdr.size = aosp_img_size;
-            pwrite(fd, &b_hdr, sizeof(b_hdr), 0);
+    }
+    return 0;
+}
+
+int repack(Utf8CStr src_img, Utf8CStr out_img, bool skip_comp) {
+    const boot_img boot(src_img.c_str());
+    return repack_image(boot, src_img, out_img, skip_comp, nullptr);
+}
+
+int patch(Utf8CStr src_img, Utf8CStr out_img, const vector<string> &cpio_cmds) {
+    // test and exists end a cpio run with their status and drop the edits made so far, so an
+    // image patched with them would silently lack those edits
+    for (const auto &cmd : cpio_cmds) {
+        const size_t b = cmd.find_first_not_of(" \t");
+        const string_view op = b == string::npos ? string_view() : string_view(cmd).substr(b, cmd.find_first_of(" \t", b) - b);
+        if (op == "test" || op == "exists") {
+            fprintf(stderr, "patch: cpio command [%.*s] is not supported, use cpio\n", static_cast<int>(op.size()), op.data());
+            return 1;
         }
     }
 
-    if (boot.flags[AVB1_SIGNED_FLAG]) {
-        std::vector<char> payload_buf(aosp_img_size);
-        if (pread(fd, payload_buf.data(), payload_buf.size(), off.header) ==
-            static_cast<ssize_t>(payload_buf.size())) {
-            auto sig = sign_payload(byte_view(payload_buf.data(), payload_buf.size()));
-            if (!sig.empty()) {
-                lseek(fd, off.tail, SEEK_SET);
-                xwrite(fd, sig.data(), sig.size());
+    const boot_img boot(src_img.c_str());
+
+    // The ramdisk unpack would write to RAMDISK_FILE: the unnamed entry of a vendor
+    // ramdisk table (or its first one), else the ramdisk of the image
+    patch_input in;
+    byte_view ramdisk(boot.ramdisk, boot.hdr->ramdisk_size());
+    if (boot.hdr->vendor_ramdisk_table_size()) {
+        auto tbl = boot.vendor_ramdisk_tbl();
+        if (tbl.empty()) {
+            fprintf(stderr, "patch: empty vendor ramdisk table\n");
+            return 1;
+        }
+        for (size_t i = 0; i < tbl.size(); ++i) {
+            if (tbl.begin()[i].ramdisk_name[0] == '\0') {
+                in.entry = i;
+                break;
             }
         }
+        auto &it = tbl.begin()[in.entry];
+        ramdisk = byte_view(boot.ramdisk + it.ramdisk_offset, it.ramdisk_size);
     }
 
-    delete hdr;
-    close(fd);
+    CpioArchive archive;
+    if (!archive.load(ramdisk))
+        return 1;
+    bool modified = false;
+    if (int ret = cpio_run(archive, cpio_cmds, modified); ret != 0)
+        return ret;
+
+    // The edited archive stays in memory; repack compresses it like an unpacked ramdisk.cpio
+    unique_ptr<mmap_data> raw;
+    if (modified) {
+        owned_fd mfd(xmemfd("ramdisk"));
+        if (mfd < 0 || !archive.dump(mfd))
+            return 1;
+        size_t len = lseek(mfd, 0, SEEK_END);
+        raw = make_unique<mmap_data>(mfd, len);
+        in.ramdisk = raw.get();
+    }
+    return repack_image(boot, src_img, out_img, false, &in);
 }
 
 void cleanup() {
@@ -1077,5 +1559,12 @@ void cleanup() {
     unlink(RECV_DTBO_FILE);
     unlink(DTB_FILE);
     unlink(BOOTCONFIG_FILE);
+    unlink(HASH_FILE);
+    for (int i = 0;; ++i) {
+        char name[64];
+        ssprintf(name, sizeof(name), KER_DTB_FILE ".%d", i);
+        if (unlink(name) != 0)
+            break;
+    }
     rm_rf(VND_RAMDISK_DIR);
 }
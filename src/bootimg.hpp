@@ -96,6 +96,52 @@ struct AvbVBMetaImageHeader {
     std::array<uint8_t, 80> reserved;
 } __attribute__((packed));
 
+struct AvbDescriptor {
+    uint64_t tag;
+    uint64_t num_bytes_following;
+} __attribute__((packed));
+
+/* Followed by partition_name, salt and digest */
+struct AvbHashDescriptor {
+    AvbDescriptor parent_descriptor;
+    uint64_t image_size;
+    std::array<uint8_t, 32> hash_algorithm;
+    uint32_t partition_name_len;
+    uint32_t salt_len;
+    uint32_t digest_len;
+    uint32_t flags;
+    std::array<uint8_t, 60> reserved;
+} __attribute__((packed));
+
+/* Followed by partition_name, salt and root_digest */
+struct AvbHashtreeDescriptor {
+    AvbDescriptor parent_descriptor;
+    uint32_t dm_verity_version;
+    uint64_t image_size;
+    uint64_t tree_offset;
+    uint64_t tree_size;
+    uint32_t data_block_size;
+    uint32_t hash_block_size;
+    uint32_t fec_num_roots;
+    uint64_t fec_offset;
+    uint64_t fec_size;
+    std::array<uint8_t, 32> hash_algorithm;
+    uint32_t partition_name_len;
+    uint32_t salt_len;
+    uint32_t root_digest_len;
+    uint32_t flags;
+    std::array<uint8_t, 60> reserved;
+} __attribute__((packed));
+
+/* Followed by the modulus and R^2 mod modulus, both big-endian */
+struct AvbRSAPublicKeyHeader {
+    uint32_t key_num_bits;
+    uint32_t n0inv;
+} __attribute__((packed));
+
+constexpr uint64_t AVB_DESCRIPTOR_TAG_HASHTREE = 1;
+constexpr uint64_t AVB_DESCRIPTOR_TAG_HASH = 2;
+
 /*********************
  * Boot Image Headers
  *********************/
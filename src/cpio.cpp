@@ -2,6 +2,7 @@
 
 #include <array>
 #include <cerrno>
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -9,9 +10,17 @@
 #include <sstream>
 #include <string_view>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "base_host.hpp"
+#include "magiskboot.hpp"
 
 namespace {
 
@@ -36,90 +45,220 @@ static_assert(sizeof(NewcHeader) == 110, "invalid newc header size");
 
 constexpr const char* kTrailer = "TRAILER!!!";
 
-std::uint32_t parse_hex8(const char* s) {
-    std::array<char, 9> buf = {};
-    std::memcpy(buf.data(), s, 8);
-    char* end = nullptr;
-    unsigned long v = std::strtoul(buf.data(), &end, 16);
-    if (end == buf.data()) {
-        return 0;
-    }
-    return static_cast<std::uint32_t>(v);
-}
-
-std::uint32_t align4(std::uint32_t v) {
-    return (v + 3U) & ~3U;
-}
+/* Fields of a NewcHeader in header order, as indices into the array filled by decode_newc. */
+enum NewcField {
+    kIno,
+    kMode,
+    kUid,
+    kGid,
+    kNlink,
+    kMtime,
+    kFilesize,
+    kDevMajor,
+    kDevMinor,
+    kRdevMajor,
+    kRdevMinor,
+    kNamesize,
+    kCheck,
+    kNewcFields,
+};
 
-bool write_all(int fd, const void* data, std::size_t len) {
-    const auto* p = static_cast<const std::uint8_t*>(data);
-    std::size_t done = 0;
-    while (done < len) {
-        const ssize_t n = ::write(fd, p + done, len - done);
-        if (n <= 0) {
+constexpr std::array<std::uint8_t, 256> kHexValue = [] {
+    std::array<std::uint8_t, 256> t{};
+    t.fill(0xff);
+    for (int i = 0; i < 10; ++i) {
+        t['0' + i] = static_cast<std::uint8_t>(i);
+    }
+    for (int i = 0; i < 6; ++i) {
+        t['a' + i] = t['A' + i] = static_cast<std::uint8_t>(10 + i);
+    }
+    return t;
+}();
+
+bool decode_hex8(const std::uint8_t* s, std::uint32_t& out) {
+    std::uint32_t v = 0;
+    for (int i = 0; i < 8; ++i) {
+        const std::uint8_t d = kHexValue[s[i]];
+        if (d > 15) {
             return false;
         }
-        done += static_cast<std::size_t>(n);
+        v = v << 4 | d;
     }
+    out = v;
     return true;
 }
 
-void format_hex8(char* out, std::uint32_t v) {
-    std::array<char, 9> tmp = {};
-    const int ret = std::snprintf(tmp.data(), tmp.size(), "%08x", v);
-    if (ret >= 0 && static_cast<std::size_t>(ret) >= 8) {
-        std::memcpy(out, tmp.data(), 8);
+#if defined(__SSE2__) || defined(__ARM_NEON)
+/* Two 8-digit hex fields at s into out[0] and out[1]; false if any byte is not a hex digit. */
+bool decode_hex16(const std::uint8_t* s, std::uint32_t* out) {
+    std::uint8_t bytes[8];
+#if defined(__SSE2__)
+    const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+    const __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    const __m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    const __m128i is_d = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+    const __m128i is_l = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(5)), l);
+    if (_mm_movemask_epi8(_mm_or_si128(is_d, is_l)) != 0xffff) {
+        return false;
     }
-}
-
-bool write_entry(int fd, std::string_view entry_name, std::uint32_t ino, const CpioEntry& entry) {
-    NewcHeader h{};
-    std::memcpy(h.magic.data(), "070701", 6);
-    format_hex8(h.ino.data(), ino);
-    format_hex8(h.mode.data(), entry.mode);
-    format_hex8(h.uid.data(), entry.uid);
-    format_hex8(h.gid.data(), entry.gid);
-    format_hex8(h.nlink.data(), (entry.mode & S_IFMT) == S_IFDIR ? 2U : 1U);
-    format_hex8(h.mtime.data(), 0);
-    format_hex8(h.filesize.data(), static_cast<std::uint32_t>(entry.data.size()));
-    format_hex8(h.devmajor.data(), 0);
-    format_hex8(h.devminor.data(), 0);
-    format_hex8(h.rdevmajor.data(), entry.rdev_major);
-    format_hex8(h.rdevminor.data(), entry.rdev_minor);
-    format_hex8(h.namesize.data(), static_cast<std::uint32_t>(entry_name.size() + 1));
-    format_hex8(h.check.data(), 0);
-
-    if (!write_all(fd, &h, sizeof(h))) {
+    const __m128i v = _mm_or_si128(_mm_and_si128(is_d, d), _mm_andnot_si128(is_d, _mm_add_epi8(l, _mm_set1_epi8(10))));
+    /* Each 16-bit lane holds a high nibble (first digit) and a low one: fold them into a byte. */
+    const __m128i b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0xff)), 4), _mm_srli_epi16(v, 8));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(bytes), _mm_packus_epi16(b, b));
+#else
+    const uint8x16_t c = vld1q_u8(s);
+    const uint8x16_t d = vsubq_u8(c, vdupq_n_u8('0'));
+    const uint8x16_t l = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+    const uint8x16_t is_d = vcleq_u8(d, vdupq_n_u8(9));
+    const uint8x16_t is_l = vcleq_u8(l, vdupq_n_u8(5));
+    /* No vminvq_u8 on ARMv7: fold the halves together and test the 64-bit lane instead. */
+    const uint8x16_t ok = vorrq_u8(is_d, is_l);
+    if (vget_lane_u64(vreinterpret_u64_u8(vand_u8(vget_low_u8(ok), vget_high_u8(ok))), 0) != ~0ULL) {
         return false;
     }
-    if (!write_all(fd, entry_name.data(), entry_name.size()) || !write_all(fd, "\0", 1)) {
+    const uint16x8_t v = vreinterpretq_u16_u8(vbslq_u8(is_d, d, vaddq_u8(l, vdupq_n_u8(10))));
+    /* Each 16-bit lane holds a high nibble (first digit) and a low one: fold them into a byte. */
+    vst1_u8(bytes, vmovn_u16(vorrq_u16(vshlq_n_u16(vandq_u16(v, vdupq_n_u16(0xff)), 4), vshrq_n_u16(v, 8))));
+#endif
+    for (int i = 0; i < 2; ++i) {
+        const std::uint8_t* q = bytes + 4 * i;
+        out[i] = static_cast<std::uint32_t>(q[0]) << 24 | static_cast<std::uint32_t>(q[1]) << 16 |
+                 static_cast<std::uint32_t>(q[2]) << 8 | q[3];
+    }
+    return true;
+}
+#endif
+
+/* Validate the magic of the newc header at p and decode its thirteen hex fields into out.
+ * Unlike strtoul, any byte that is not a hex digit rejects the header. */
+bool decode_newc(const std::uint8_t* p, std::uint32_t (&out)[kNewcFields]) {
+    static_assert(6 + kNewcFields * 8 == sizeof(NewcHeader));
+    if (std::memcmp(p, "070701", 6) != 0) {
         return false;
     }
-    /* Pad so next header is at align_4(sizeof(NewcHeader) + namesize), matching load(). */
-    const std::uint32_t namesize = static_cast<std::uint32_t>(entry_name.size() + 1);
-    const std::uint32_t pos_after_name = sizeof(NewcHeader) + namesize;
-    const std::uint32_t next_aligned = (pos_after_name + 3) & ~3U;
-    const std::uint32_t name_pad_len = next_aligned - pos_after_name;
-    if (name_pad_len != 0) {
-        const std::array<std::uint8_t, 3> zeros = {0, 0, 0};
-        if (!write_all(fd, zeros.data(), name_pad_len)) {
+    const std::uint8_t* f = p + 6;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+    /* Fields 0..11 in pairs; the odd one out takes the scalar path below. */
+    int i = 0;
+    for (; i + 1 < kNewcFields; i += 2) {
+        if (!decode_hex16(f + 8 * i, out + i)) {
             return false;
         }
     }
-    if (!entry.data.empty() && !write_all(fd, entry.data.data(), entry.data.size())) {
-        return false;
-    }
-    const std::uint32_t data_pad =
-        align4(static_cast<std::uint32_t>(entry.data.size())) - static_cast<std::uint32_t>(entry.data.size());
-    if (data_pad != 0) {
-        const std::array<std::uint8_t, 3> zeros = {0, 0, 0};
-        if (!write_all(fd, zeros.data(), data_pad)) {
+#else
+    int i = 0;
+#endif
+    for (; i < kNewcFields; ++i) {
+        if (!decode_hex8(f + 8 * i, out[i])) {
             return false;
         }
     }
     return true;
 }
 
+std::size_t align4(std::size_t v) {
+    return (v + 3U) & ~static_cast<std::size_t>(3);
+}
+
+/* Encodes newc records into a reusable buffer and hands them to writev in batches. Entry
+ * contents are not copied (except tiny ones): they go out as iovecs pointing at the entry. */
+class NewcWriter {
+public:
+    explicit NewcWriter(int fd) : fd_(fd) {}
+
+    bool add(std::string_view name, std::uint32_t ino, const CpioEntry& entry) {
+        const byte_view data = entry.data();
+        const auto namesize = static_cast<std::uint32_t>(name.size() + 1);
+        const std::uint32_t fields[] = {
+            ino,
+            entry.mode,
+            entry.uid,
+            entry.gid,
+            (entry.mode & S_IFMT) == S_IFDIR ? 2U : 1U,
+            0, /* mtime */
+            static_cast<std::uint32_t>(data.size()),
+            0, /* devmajor */
+            0, /* devminor */
+            entry.rdev_major,
+            entry.rdev_minor,
+            namesize,
+            0, /* check */
+        };
+        static_assert(6 + sizeof(fields) / sizeof(fields[0]) * 8 == sizeof(NewcHeader));
+
+        /* Pad so next header is at align_4(sizeof(NewcHeader) + namesize), matching load(). */
+        const std::size_t head = align4(sizeof(NewcHeader) + namesize);
+        char* out = reserve(head);
+        std::memcpy(out, "070701", 6);
+        out += 6;
+        for (std::uint32_t v : fields) {
+            for (int i = 7; i >= 0; --i, v >>= 4) {
+                out[i] = kHexDigits[v & 0xf];
+            }
+            out += 8;
+        }
+        std::memcpy(out, name.data(), name.size());
+        std::memset(out + name.size(), 0, head - sizeof(NewcHeader) - name.size());
+
+        if (data.size() > kInlineData) {
+            segs_.push_back({data.data(), 0, data.size()});
+        } else if (data.size() != 0) {
+            std::memcpy(reserve(data.size()), data.data(), data.size());
+        }
+        if (const std::size_t pad = align4(data.size()) - data.size(); pad != 0) {
+            std::memset(reserve(pad), 0, pad);
+        }
+
+        if (segs_.size() >= kMaxSegs || buf_.size() >= kFlushSize) {
+            return flush();
+        }
+        return true;
+    }
+
+    bool flush() {
+        std::vector<iovec> iov(segs_.size());
+        for (std::size_t i = 0; i < segs_.size(); ++i) {
+            const auto& seg = segs_[i];
+            iov[i].iov_base = const_cast<std::uint8_t*>(seg.ptr ? seg.ptr : buf_.data() + seg.off);
+            iov[i].iov_len = seg.len;
+        }
+        const bool ok = xwritev_all(fd_, iov.data(), iov.size());
+        segs_.clear();
+        buf_.clear();
+        return ok;
+    }
+
+private:
+    static constexpr char kHexDigits[] = "0123456789abcdef";
+    /* Contents up to this size are copied next to their header instead of taking an iovec. */
+    static constexpr std::size_t kInlineData = 256;
+    static constexpr std::size_t kMaxSegs = IOV_MAX;
+    static constexpr std::size_t kFlushSize = 1 << 20;
+
+    /* A run of buf_ (ptr == nullptr) or entry contents. buf_ may grow while a batch is built,
+     * so runs of it are kept as offsets until flush. */
+    struct Seg {
+        const std::uint8_t* ptr;
+        std::size_t off;
+        std::size_t len;
+    };
+
+    char* reserve(std::size_t len) {
+        const std::size_t off = buf_.size();
+        buf_.resize(off + len);
+        if (!segs_.empty() && segs_.back().ptr == nullptr) {
+            segs_.back().len += len;
+        } else if (len != 0) {
+            segs_.push_back({nullptr, off, len});
+        }
+        return reinterpret_cast<char*>(buf_.data() + off);
+    }
+
+    int fd_;
+    std::vector<std::uint8_t> buf_;
+    std::vector<Seg> segs_;
+};
+
 std::vector<std::string> split_ws(const std::string& s) {
     std::istringstream iss(s);
     std::vector<std::string> out;
@@ -132,34 +271,48 @@ std::vector<std::string> split_ws(const std::string& s) {
 
 }  // namespace
 
-std::string CpioArchive::normalize_path(const std::string& path) {
-    std::vector<std::string> segs;
-    std::string current;
-    for (char c : path) {
-        if (c == '/') {
-            if (!current.empty() && current != ".") {
-                segs.push_back(current);
-            }
-            current.clear();
-            continue;
+std::string_view CpioArchive::normalize_path(std::string_view path, std::string& buf) {
+    /* Drop empty and "." segments. Names in real archives are nearly always canonical already,
+     * so only build a copy in buf when something has to go. */
+    bool canonical = true;
+    for (std::size_t pos = 0; canonical && pos <= path.size();) {
+        std::size_t end = path.find('/', pos);
+        if (end == std::string_view::npos) {
+            end = path.size();
         }
-        current.push_back(c);
+        const std::string_view seg = path.substr(pos, end - pos);
+        canonical = !seg.empty() && seg != ".";
+        pos = end + 1;
     }
-    if (!current.empty() && current != ".") {
-        segs.push_back(current);
+    if (canonical) {
+        return path;
     }
-    std::string out;
-    for (std::size_t i = 0; i < segs.size(); ++i) {
-        if (i != 0) {
-            out.push_back('/');
+    buf.clear();
+    for (std::size_t pos = 0; pos <= path.size();) {
+        std::size_t end = path.find('/', pos);
+        if (end == std::string_view::npos) {
+            end = path.size();
         }
-        out += segs[i];
+        const std::string_view seg = path.substr(pos, end - pos);
+        if (!seg.empty() && seg != ".") {
+            if (!buf.empty()) {
+                buf.push_back('/');
+            }
+            buf += seg;
+        }
+        pos = end + 1;
     }
-    return out;
+    return buf;
+}
+
+std::string_view CpioArchive::store_name(std::string_view path) {
+    std::string buf;
+    const std::string_view name = normalize_path(path, buf);
+    return names_.emplace_back(name);
 }
 
 bool CpioArchive::load(const std::string& path) {
-    entries_.clear();
+    clear();
     struct stat st {};
     if (::stat(path.c_str(), &st) != 0) {
         if (errno == ENOENT) {
@@ -172,30 +325,61 @@ bool CpioArchive::load(const std::string& path) {
         return true;
     }
 
-    mmap_data data(path.c_str(), false);
-    if (data.data() == nullptr || data.size() == 0) {
-        PLOGE("mmap %s", path.c_str());
+    /* Entries reference the mapping instead of copying names and contents out of it. */
+    source_ = std::make_unique<mmap_data>(path.c_str(), false);
+    if (source_->data() == nullptr || source_->size() == 0) {
+        source_.reset();
         return false;
     }
+    return parse(byte_view(source_->data(), source_->size()));
+}
+
+bool CpioArchive::load(byte_view data) {
+    clear();
+    return data.size() == 0 || parse(data);
+}
+
+void CpioArchive::clear() {
+    entries_.clear();
+    names_.clear();
+    source_.reset();
+    format_ = FileFormat::UNKNOWN;
+}
+
+bool CpioArchive::parse(byte_view data) {
+    /* Compressed ramdisk (unpack with --skip-decomp): decompress into memory, edit there, and
+     * let dump() compress back to the same format. */
+    format_ = check_fmt(data.data(), data.size());
+    if (fmt_compressed(format_)) {
+        owned_fd mfd(xmemfd("cpio"));
+        decompress_bytes(format_, data, mfd);
+        const auto len = static_cast<std::size_t>(::lseek(mfd, 0, SEEK_END));
+        source_.reset();
+        if (len == 0) {
+            return true;
+        }
+        source_ = std::make_unique<mmap_data>(mfd, len);
+        if (source_->data() == nullptr) {
+            source_.reset();
+            return false;
+        }
+        data = byte_view(source_->data(), source_->size());
+    }
 
     const auto* p = data.data();
     std::size_t off = 0;
     const std::size_t total = data.size();
 
-    /* Reject LZ4 legacy ramdisk (unpack with --skip-decomp). Otherwise we might find "070701"
-     * by chance in the stream and parse garbage as cpio → huge memory/cache and hang. */
-    static constexpr unsigned char kLz4LegacyMagic[] = {0x02, 0x21, 0x4c, 0x18};
-    if (total >= 4 && std::memcmp(p, kLz4LegacyMagic, 4) == 0) {
-        LOGE("Input is LZ4 compressed ramdisk, not cpio; decompress ramdisk first\n");
-        return false;
-    }
-
     static constexpr std::array<char, 7> kNewcMagic = {"070701"};
 
     /* Match Magisk native/src/boot/cpio.rs load_from_data() exactly */
     while (off + sizeof(NewcHeader) <= total) {
-        const auto* h = reinterpret_cast<const NewcHeader*>(p + off);
-        if (std::memcmp(h->magic.data(), kNewcMagic.data(), 6) != 0) {
+        std::uint32_t fields[kNewcFields];
+        if (!decode_newc(p + off, fields)) {
+            if (std::memcmp(p + off, kNewcMagic.data(), 6) == 0) {
+                LOGE("Invalid cpio header at offset %zu\n", off);
+                return false;
+            }
             /* Only at start: skip leading padding (some images have a few bytes before first header).
              * Search only the first 512 bytes. If we searched the whole file, non-cpio data (e.g. LZ4
              * ramdisk when unpack used --skip-decomp) would often contain "070701" by chance; we would
@@ -223,12 +407,12 @@ bool CpioArchive::load(const std::string& path) {
         }
 
         off += sizeof(NewcHeader);
-        const std::uint32_t namesize = parse_hex8(h->namesize.data());
+        const std::uint32_t namesize = fields[kNamesize];
         if (namesize == 0 || off + namesize > total) {
             LOGE("Invalid cpio namesize\n");
             return false;
         }
-        std::string name(reinterpret_cast<const char*>(p + off), namesize > 0 ? namesize - 1 : 0);
+        const std::string_view name(reinterpret_cast<const char*>(p + off), namesize - 1);
         /* newc: pathname is namesize bytes, then NUL padding to 4-byte boundary (pos = align_4(pos)). */
         off += static_cast<std::size_t>(namesize);
         off = (off + 3) & ~static_cast<std::size_t>(3);
@@ -253,24 +437,20 @@ bool CpioArchive::load(const std::string& path) {
             continue;
         }
 
-        const std::uint32_t mode = parse_hex8(h->mode.data());
-        const std::uint32_t uid = parse_hex8(h->uid.data());
-        const std::uint32_t gid = parse_hex8(h->gid.data());
-        const std::uint32_t filesize = parse_hex8(h->filesize.data());
-        const std::uint32_t rdev_major = parse_hex8(h->rdevmajor.data());
-        const std::uint32_t rdev_minor = parse_hex8(h->rdevminor.data());
+        const std::uint32_t filesize = fields[kFilesize];
         if (off + filesize > total) {
             LOGE("Invalid cpio filesize\n");
             return false;
         }
-        CpioEntry entry;
-        entry.mode = mode;
-        entry.uid = uid;
-        entry.gid = gid;
-        entry.rdev_major = rdev_major;
-        entry.rdev_minor = rdev_minor;
-        entry.data.assign(p + off, p + off + filesize);
-        entries_[normalize_path(name)] = std::move(entry);
+        std::string buf;
+        const std::string_view key = normalize_path(name, buf);
+        CpioEntry& entry = entries_[key.data() == name.data() ? key : store_name(key)];
+        entry.mode = fields[kMode];
+        entry.uid = fields[kUid];
+        entry.gid = fields[kGid];
+        entry.rdev_major = fields[kRdevMajor];
+        entry.rdev_minor = fields[kRdevMinor];
+        entry.set_view(byte_view(p + off, filesize));
         off += static_cast<std::size_t>(filesize);
         off = (off + 3) & ~static_cast<std::size_t>(3); /* align_4(pos) like Magisk */
     }
@@ -278,32 +458,77 @@ bool CpioArchive::load(const std::string& path) {
     return true;
 }
 
-bool CpioArchive::dump(const std::string& path) const {
-    int fd = xopen(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
-    if (fd < 0) {
-        return false;
-    }
-    owned_fd owned(fd);
-
+bool CpioArchive::write_entries(int fd) const {
+    NewcWriter writer(fd);
     std::uint32_t ino = 1;
     for (const auto& [name, entry] : entries_) {
-        if (!write_entry(fd, name, ino++, entry)) {
-            PLOGE("write cpio entry");
+        if (!writer.add(name, ino++, entry)) {
             return false;
         }
     }
 
     CpioEntry trailer;
     trailer.mode = S_IFREG;
-    if (!write_entry(fd, kTrailer, ino, trailer)) {
-        PLOGE("write cpio trailer");
+    return writer.add(kTrailer, ino, trailer) && writer.flush();
+}
+
+bool CpioArchive::dump(int fd) const {
+    return write_entries(fd);
+}
+
+bool CpioArchive::dump(const std::string& path) const {
+    /* Unmodified entries still point into the mapping of the loaded archive, which is usually
+     * this very file: write a sibling and rename it over instead of truncating under the mapping. */
+    std::string tmp = path + ".XXXXXX";
+    int fd = ::mkstemp(tmp.data());
+    if (fd < 0) {
+        PLOGE("mkstemp %s", tmp.c_str());
+        return false;
+    }
+    owned_fd owned(fd);
+    struct stat st {};
+    if (::stat(path.c_str(), &st) == 0) {
+        ::fchmod(fd, st.st_mode & 07777);
+    } else {
+        const mode_t mask = ::umask(0);
+        ::umask(mask);
+        ::fchmod(fd, 0644 & ~mask);
+    }
+    auto fail = [&](const char* what) {
+        PLOGE("%s", what);
+        ::unlink(tmp.c_str());
         return false;
+    };
+
+    bool ok = false;
+    if (fmt_compressed(format_)) {
+        /* The archive is built in memory and only its compressed form reaches the disk. */
+        owned_fd mfd(xmemfd("cpio"));
+        if (mfd >= 0 && write_entries(mfd)) {
+            mmap_data raw(mfd, static_cast<std::size_t>(::lseek(mfd, 0, SEEK_END)));
+            try {
+                compress_bytes(format_, byte_view(raw.data(), raw.size()), fd);
+            } catch (...) {
+                ::unlink(tmp.c_str());
+                throw;
+            }
+            ok = true;
+        }
+    } else {
+        ok = write_entries(fd);
+    }
+    if (!ok) {
+        return fail("write cpio");
+    }
+    if (::rename(tmp.c_str(), path.c_str()) != 0) {
+        return fail("rename cpio");
     }
     return true;
 }
 
 bool CpioArchive::exists(const std::string& path) const {
-    return entries_.find(normalize_path(path)) != entries_.end();
+    std::string buf;
+    return entries_.find(normalize_path(path, buf)) != entries_.end();
 }
 
 int CpioArchive::test() const {
@@ -329,8 +554,8 @@ bool CpioArchive::add(std::uint32_t mode, std::string_view cpio_path, const std:
     entry.mode = (mode & 07777U) | S_IFREG;
     entry.uid = 0;
     entry.gid = 0;
-    entry.data = std::move(data);
-    entries_[normalize_path(std::string(cpio_path))] = std::move(entry);
+    entry.edit() = std::move(data);
+    entries_[store_name(cpio_path)] = std::move(entry);
     return true;
 }
 
@@ -339,32 +564,30 @@ bool CpioArchive::mkdir(std::uint32_t mode, const std::string& path) {
     entry.mode = (mode & 07777U) | S_IFDIR;
     entry.uid = 0;
     entry.gid = 0;
-    entry.data.clear();
-    entries_[normalize_path(path)] = std::move(entry);
+    entries_[store_name(path)] = std::move(entry);
     return true;
 }
 
 bool CpioArchive::rm(const std::string& path) {
-    return entries_.erase(normalize_path(path)) > 0;
+    std::string buf;
+    return entries_.erase(normalize_path(path, buf)) > 0;
 }
 
 bool CpioArchive::mv(const std::string& from, const std::string& to) {
-    const auto from_norm = normalize_path(from);
-    const auto to_norm = normalize_path(to);
-    auto it = entries_.find(from_norm);
+    std::string buf;
+    auto it = entries_.find(normalize_path(from, buf));
     if (it == entries_.end()) {
         return false;
     }
-    entries_[to_norm] = std::move(it->second);
+    /* Renaming keeps the contents where they are; only the key is new. */
+    CpioEntry entry = std::move(it->second);
     entries_.erase(it);
+    entries_[store_name(to)] = std::move(entry);
     return true;
 }
 
-int cpio_commands(const std::string& file, const std::vector<std::string>& cmds) {
-    CpioArchive archive;
-    if (!archive.load(file)) {
-        return 1;
-    }
+int cpio_run(CpioArchive& archive, const std::vector<std::string>& cmds, bool& modified) {
+    modified = false;
     bool dirty = false;
 
     for (const auto& raw : cmds) {
@@ -434,8 +657,19 @@ int cpio_commands(const std::string& file, const std::vector<std::string>& cmds)
         return 1;
     }
 
-    if (dirty) {
+    modified = dirty;
+    return 0;
+}
+
+int cpio_commands(const std::string& file, const std::vector<std::string>& cmds) {
+    CpioArchive archive;
+    if (!archive.load(file)) {
+        return 1;
+    }
+    bool modified = false;
+    const int ret = cpio_run(archive, cmds, modified);
+    if (modified) {
         return archive.dump(file) ? 0 : 1;
     }
-    return 0;
+    return ret;
 }
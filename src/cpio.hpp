@@ -1,24 +1,57 @@
 #pragma once
 
 #include <cstdint>
+#include <deque>
 #include <map>
+#include <memory>
 #include <string>
 #include <string_view>
 #include <vector>
 
+#include "base_host.hpp"
+#include "boot_crypto.hpp"
+
 struct CpioEntry {
     std::uint32_t mode = 0;
     std::uint32_t uid = 0;
     std::uint32_t gid = 0;
     std::uint32_t rdev_major = 0;
     std::uint32_t rdev_minor = 0;
-    std::vector<std::uint8_t> data;
+
+    // File contents. Entries read by CpioArchive::load reference the archive mapping
+    // until they are modified.
+    [[nodiscard]] byte_view data() const {
+        return owned_ ? byte_view(buf_.data(), buf_.size()) : view_;
+    }
+    void set_view(byte_view v) {
+        view_ = v;
+        buf_.clear();
+        owned_ = false;
+    }
+    // Copy-on-write access: detaches the contents from the archive mapping.
+    std::vector<std::uint8_t>& edit() {
+        if (!owned_) {
+            buf_.assign(view_.data(), view_.data() + view_.size());
+            view_ = byte_view();
+            owned_ = true;
+        }
+        return buf_;
+    }
+
+private:
+    byte_view view_;
+    std::vector<std::uint8_t> buf_;
+    bool owned_ = false;
 };
 
 class CpioArchive {
 public:
     bool load(const std::string& path);
+    // Loads from data, which must outlive the archive unless it is compressed.
+    bool load(byte_view data);
     [[nodiscard]] bool dump(const std::string& path) const;
+    // Writes the uncompressed archive to fd, whatever format it was loaded from.
+    [[nodiscard]] bool dump(int fd) const;
 
     [[nodiscard]] bool exists(const std::string& path) const;
     [[nodiscard]] int test() const;
@@ -29,8 +62,21 @@ public:
     bool mv(const std::string& from, const std::string& to);
 
 private:
-    static std::string normalize_path(const std::string& path);
-    std::map<std::string, CpioEntry> entries_;
+    void clear();
+    bool parse(byte_view data);
+    static std::string_view normalize_path(std::string_view path, std::string& buf);
+    std::string_view store_name(std::string_view path);
+    bool write_entries(int fd) const;
+
+    // Keys point into the archive mapping or into names_.
+    std::unique_ptr<mmap_data> source_;
+    std::deque<std::string> names_;
+    std::map<std::string_view, CpioEntry> entries_;
+    // Compression of the file load() read; dump() writes the same format.
+    FileFormat format_ = FileFormat::UNKNOWN;
 };
 
+// Runs cmds on archive; test and exists end the run with their result. Returns the exit
+// status, with modified set when every command ran and the archive changed.
+int cpio_run(CpioArchive& archive, const std::vector<std::string>& cmds, bool& modified);
 int cpio_commands(const std::string& file, const std::vector<std::string>& cmds);
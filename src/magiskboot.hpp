@@ -3,6 +3,7 @@
 #include <cstdint>
 #include <cstring>
 #include <string>
+#include <vector>
 
 #include "base_host.hpp"
 #include "boot_crypto.hpp"
@@ -12,20 +13,24 @@ using Utf8CStr = std::string;
 
 // Internal APIs (implemented in bootimg.cpp)
 int unpack(Utf8CStr image, bool skip_decomp = false, bool hdr = false);
-void repack(Utf8CStr src_img, Utf8CStr out_img, bool skip_comp = false);
-int split_image_dtb(Utf8CStr filename, bool skip_decomp = false);
+int repack(Utf8CStr src_img, Utf8CStr out_img, bool skip_comp = false);
+// unpack, cpio cpio_cmds on the ramdisk and repack in one pass, without files in between
+int patch(Utf8CStr src_img, Utf8CStr out_img, const std::vector<std::string> &cpio_cmds);
+int split_image_dtb(Utf8CStr filename, bool skip_decomp = false, bool all = false);
 void cleanup();
+// Every valid device tree in buf, in order (at most max)
+std::vector<byte_view> find_dtbs(byte_view buf, size_t max = SIZE_MAX);
 FileFormat check_fmt(const void *buf, size_t len);
 
 // Public APIs (wrappers in bootimg.cpp)
 inline int unpack(const char *image, bool skip_decomp = false, bool hdr = false) {
     return unpack(Utf8CStr(image), skip_decomp, hdr);
 }
-inline void repack(const char *src_img, const char *out_img, bool skip_comp = false) {
-    repack(Utf8CStr(src_img), Utf8CStr(out_img), skip_comp);
+inline int repack(const char *src_img, const char *out_img, bool skip_comp = false) {
+    return repack(Utf8CStr(src_img), Utf8CStr(out_img), skip_comp);
 }
-inline int split_image_dtb(const char *filename, bool skip_decomp = false) {
-    return split_image_dtb(Utf8CStr(filename), skip_decomp);
+inline int split_image_dtb(const char *filename, bool skip_decomp = false, bool all = false) {
+    return split_image_dtb(Utf8CStr(filename), skip_decomp, all);
 }
 
 #define HEADER_FILE     "header"
@@ -38,6 +43,7 @@ inline int split_image_dtb(const char *filename, bool skip_decomp = false) {
 #define RECV_DTBO_FILE  "recovery_dtbo"
 #define DTB_FILE        "dtb"
 #define BOOTCONFIG_FILE "bootconfig"
+#define HASH_FILE       ".unpack_hashes"
 #define NEW_BOOT        "new-boot.img"
 
 #define BUFFER_MATCH(buf, s) (std::memcmp(buf, s, sizeof(s) - 1) == 0)
@@ -52,6 +58,7 @@ inline int split_image_dtb(const char *filename, bool skip_decomp = false) {
 #define LZOP_MAGIC      "\x89""LZO"
 #define XZ_MAGIC        "\xfd""7zXZ"
 #define BZIP_MAGIC      "BZh"
+#define ZSTD_MAGIC      "\x28\xb5\x2f\xfd"
 #define LZ4_LEG_MAGIC   "\x02\x21\x4c\x18"
 #define LZ41_MAGIC      "\x03\x21\x4c\x18"
 #define LZ42_MAGIC      "\x04\x22\x4d\x18"
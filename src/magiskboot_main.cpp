@@ -1,7 +1,9 @@
 #include <cstdio>
+#include <cstdlib>
 #include <string>
 #include <vector>
 
+#include "avb.hpp"
 #include "cpio.hpp"
 #include "magiskboot.hpp"
 
@@ -12,8 +14,11 @@ int magiskboot_main(int argc, char **argv) {
                      "Usage:\n"
                      "  magiskboot unpack <boot.img> [--skip-decomp] [--hdr]\n"
                      "  magiskboot repack <in-boot.img> <out-boot.img> [--skip-comp]\n"
-                     "  magiskboot split-dtb <kernel-or-boot.img> [--skip-decomp]\n"
-                     "  magiskboot cpio <ramdisk.cpio> <command> [command...]\n");
+                     "  magiskboot split-dtb <kernel-or-boot.img> [--skip-decomp] [--all]\n"
+                     "  magiskboot cpio <ramdisk.cpio> <command> [command...]\n"
+                     "  magiskboot patch <in-boot.img> <out-boot.img> --cpio <command> [command...]\n"
+                     "  magiskboot avb-verify <boot.img>\n"
+                     "  magiskboot avb-sign <boot.img> [key.pem]\n");
         return 1;
     }
 
@@ -39,15 +44,16 @@ int magiskboot_main(int argc, char **argv) {
             for (int i = 3; i < argc; ++i) {
                 if (std::string(argv[i]) == "--skip-comp") skip_comp = true;
             }
-            repack(src, dst, skip_comp);
-            return 0;
+            return repack(src, dst, skip_comp);
         } else if (cmd == "split-dtb") {
             const char *img = argv[2];
             bool skip_decomp = false;
+            bool all = false;
             for (int i = 3; i < argc; ++i) {
                 if (std::string(argv[i]) == "--skip-decomp") skip_decomp = true;
+                if (std::string(argv[i]) == "--all") all = true;
             }
-            return split_image_dtb(img, skip_decomp);
+            return split_image_dtb(img, skip_decomp, all);
         } else if (cmd == "cpio") {
             if (argc < 4) {
                 std::fprintf(stderr, "cpio needs <ramdisk.cpio> <command> [command...]\n");
@@ -58,6 +64,22 @@ int magiskboot_main(int argc, char **argv) {
                 commands.emplace_back(argv[i]);
             }
             return cpio_commands(argv[2], commands);
+        } else if (cmd == "patch") {
+            if (argc < 6 || std::string(argv[4]) != "--cpio") {
+                std::fprintf(stderr, "patch needs <in-boot.img> <out-boot.img> --cpio <command> [command...]\n");
+                return 1;
+            }
+            std::vector<std::string> commands;
+            for (int i = 5; i < argc; ++i) {
+                commands.emplace_back(argv[i]);
+            }
+            return patch(argv[2], argv[3], commands);
+        } else if (cmd == "avb-verify") {
+            return avb_verify(argv[2]);
+        } else if (cmd == "avb-sign") {
+            const char *key = (argc >= 4) ? argv[3] : std::getenv("MAGISKBOOT_AVB_KEY");
+            if (key && *key == '\0') key = nullptr;
+            return avb_sign(argv[2], key);
         } else {
             std::fprintf(stderr, "Unknown command: %s\n", cmd.c_str());
             return 1;
@@ -0,0 +1,362 @@
+#include <algorithm>
+#include <cstring>
+
+#if defined(USE_SHA_NI)
+#include <cpuid.h>
+#endif
+#if defined(USE_SHA_ARMV8) && defined(__linux__)
+#include <sys/auxv.h>
+#endif
+
+#include "sha.hpp"
+
+const std::uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+namespace {
+
+constexpr std::uint32_t SHA1_IV[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+constexpr std::uint32_t SHA256_IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+inline std::uint32_t rol(std::uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+inline std::uint32_t ror(std::uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+inline std::uint32_t load_be32(const std::uint8_t *p) {
+    return (static_cast<std::uint32_t>(p[0]) << 24) | (static_cast<std::uint32_t>(p[1]) << 16) |
+           (static_cast<std::uint32_t>(p[2]) << 8) | static_cast<std::uint32_t>(p[3]);
+}
+
+inline void store_be32(std::uint8_t *p, std::uint32_t v) {
+    p[0] = static_cast<std::uint8_t>(v >> 24);
+    p[1] = static_cast<std::uint8_t>(v >> 16);
+    p[2] = static_cast<std::uint8_t>(v >> 8);
+    p[3] = static_cast<std::uint8_t>(v);
+}
+
+#if defined(USE_SHA_NI)
+bool cpu_has_sha_ni() {
+    unsigned a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d))
+        return false;
+    // The kernels also use SSSE3 (pshufb) and SSE4.1 (pblendw, pextrd)
+    if (!(c & (1u << 9)) || !(c & (1u << 19)))
+        return false;
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+        return false;
+    return b & (1u << 29);
+}
+#endif
+
+#if defined(USE_SHA_ARMV8)
+bool cpu_has_armv8_sha() {
+#if defined(__APPLE__)
+    return true;
+#elif defined(__linux__)
+    constexpr unsigned long hwcap_sha1 = 1UL << 5;
+    constexpr unsigned long hwcap_sha2 = 1UL << 6;
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    return (hwcap & hwcap_sha1) && (hwcap & hwcap_sha2);
+#else
+    return false;
+#endif
+}
+#endif
+
+struct sha_kernels {
+    sha_blocks_fn sha1 = sha1_blocks_c;
+    sha_blocks_fn sha256 = sha256_blocks_c;
+
+    sha_kernels() {
+#if defined(USE_SHA_NI)
+        if (cpu_has_sha_ni()) {
+            sha1 = sha1_blocks_shani;
+            sha256 = sha256_blocks_shani;
+        }
+#elif defined(USE_SHA_ARMV8)
+        if (cpu_has_armv8_sha()) {
+            sha1 = sha1_blocks_armv8;
+            sha256 = sha256_blocks_armv8;
+        }
+#endif
+    }
+};
+
+const sha_kernels &kernels() {
+    static const sha_kernels k;
+    return k;
+}
+
+inline void sha_blocks(sha_ctx &ctx, const std::uint8_t *p, std::size_t n) {
+    (ctx.sha256 ? kernels().sha256 : kernels().sha1)(ctx.h, p, n);
+}
+
+} // namespace
+
+// One SHA-1 / SHA-256 round on named registers; callers rotate the names instead of
+// shuffling values between variables.
+#define SHA1_ROUND(a, b, c, d, e, f, k, w) \
+    e += rol(a, 5) + (f) + (k) + (w);      \
+    b = rol(b, 30)
+
+#define SHA1_ROUNDS5(i, F, k)                                   \
+    SHA1_ROUND(a, b, c, d, e, F(b, c, d), k, w[(i) + 0]);       \
+    SHA1_ROUND(e, a, b, c, d, F(a, b, c), k, w[(i) + 1]);       \
+    SHA1_ROUND(d, e, a, b, c, F(e, a, b), k, w[(i) + 2]);       \
+    SHA1_ROUND(c, d, e, a, b, F(d, e, a), k, w[(i) + 3]);       \
+    SHA1_ROUND(b, c, d, e, a, F(c, d, e), k, w[(i) + 4])
+
+#define SHA1_CH(x, y, z)  (((x) & (y)) | (~(x) & (z)))
+#define SHA1_PAR(x, y, z) ((x) ^ (y) ^ (z))
+#define SHA1_MAJ(x, y, z) (((x) & (y)) | ((x) & (z)) | ((y) & (z)))
+
+void sha1_blocks_c(std::uint32_t *h, const std::uint8_t *p, std::size_t n) {
+    for (; n; --n, p += 64) {
+        std::uint32_t w[80];
+        for (int i = 0; i < 16; ++i)
+            w[i] = load_be32(p + 4 * i);
+        for (int i = 16; i < 80; ++i)
+            w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        std::uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 20; i += 5) {
+            SHA1_ROUNDS5(i, SHA1_CH, 0x5a827999);
+        }
+        for (int i = 20; i < 40; i += 5) {
+            SHA1_ROUNDS5(i, SHA1_PAR, 0x6ed9eba1);
+        }
+        for (int i = 40; i < 60; i += 5) {
+            SHA1_ROUNDS5(i, SHA1_MAJ, 0x8f1bbcdc);
+        }
+        for (int i = 60; i < 80; i += 5) {
+            SHA1_ROUNDS5(i, SHA1_PAR, 0xca62c1d6);
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+}
+
+#define SHA256_ROUND(a, b, c, d, e, f, g, h, i)                                              \
+    h += (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i]; \
+    d += h;                                                                                  \
+    h += (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c))
+
+void sha256_blocks_c(std::uint32_t *h, const std::uint8_t *p, std::size_t n) {
+    for (; n; --n, p += 64) {
+        std::uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+            w[i] = load_be32(p + 4 * i);
+        for (int i = 16; i < 64; ++i) {
+            std::uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            std::uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        std::uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+        std::uint32_t e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; i += 8) {
+            SHA256_ROUND(a, b, c, d, e, f, g, hh, i + 0);
+            SHA256_ROUND(hh, a, b, c, d, e, f, g, i + 1);
+            SHA256_ROUND(g, hh, a, b, c, d, e, f, i + 2);
+            SHA256_ROUND(f, g, hh, a, b, c, d, e, i + 3);
+            SHA256_ROUND(e, f, g, hh, a, b, c, d, i + 4);
+            SHA256_ROUND(d, e, f, g, hh, a, b, c, i + 5);
+            SHA256_ROUND(c, d, e, f, g, hh, a, b, i + 6);
+            SHA256_ROUND(b, c, d, e, f, g, hh, a, i + 7);
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+        h[5] += f;
+        h[6] += g;
+        h[7] += hh;
+    }
+}
+
+void sha_init(sha_ctx &ctx, bool sha256) {
+    std::memset(&ctx, 0, sizeof(ctx));
+    ctx.sha256 = sha256;
+    if (sha256)
+        std::memcpy(ctx.h, SHA256_IV, sizeof(SHA256_IV));
+    else
+        std::memcpy(ctx.h, SHA1_IV, sizeof(SHA1_IV));
+}
+
+void sha_update(sha_ctx &ctx, const void *data, std::size_t len) {
+    auto p = static_cast<const std::uint8_t *>(data);
+    std::size_t used = ctx.len % 64;
+    ctx.len += len;
+    if (used) {
+        std::size_t take = std::min(len, 64 - used);
+        std::memcpy(ctx.buf + used, p, take);
+        p += take;
+        len -= take;
+        if (used + take < 64)
+            return;
+        sha_blocks(ctx, ctx.buf, 1);
+    }
+    if (std::size_t n = len / 64) {
+        sha_blocks(ctx, p, n);
+        p += n * 64;
+        len -= n * 64;
+    }
+    if (len)
+        std::memcpy(ctx.buf, p, len);
+}
+
+void sha_final(sha_ctx &ctx, std::uint8_t *out) {
+    std::uint64_t bits = ctx.len * 8;
+    std::size_t used = ctx.len % 64;
+    ctx.buf[used++] = 0x80;
+    if (used > 56) {
+        std::memset(ctx.buf + used, 0, 64 - used);
+        sha_blocks(ctx, ctx.buf, 1);
+        used = 0;
+    }
+    std::memset(ctx.buf + used, 0, 56 - used);
+    store_be32(ctx.buf + 56, static_cast<std::uint32_t>(bits >> 32));
+    store_be32(ctx.buf + 60, static_cast<std::uint32_t>(bits));
+    sha_blocks(ctx, ctx.buf, 1);
+
+    for (std::size_t i = 0; i < sha_digest_size(ctx) / 4; ++i)
+        store_be32(out + 4 * i, ctx.h[i]);
+}
+
+std::size_t sha_digest_size(const sha_ctx &ctx) {
+    return ctx.sha256 ? 32 : 20;
+}
+
+namespace {
+
+constexpr std::uint64_t SHA512_K[80] = {
+    0x428a2f98d728ae22, 0x7137449123ef65cd, 0xb5c0fbcfec4d3b2f, 0xe9b5dba58189dbbc, 0x3956c25bf348b538,
+    0x59f111f1b605d019, 0x923f82a4af194f9b, 0xab1c5ed5da6d8118, 0xd807aa98a3030242, 0x12835b0145706fbe,
+    0x243185be4ee4b28c, 0x550c7dc3d5ffb4e2, 0x72be5d74f27b896f, 0x80deb1fe3b1696b1, 0x9bdc06a725c71235,
+    0xc19bf174cf692694, 0xe49b69c19ef14ad2, 0xefbe4786384f25e3, 0x0fc19dc68b8cd5b5, 0x240ca1cc77ac9c65,
+    0x2de92c6f592b0275, 0x4a7484aa6ea6e483, 0x5cb0a9dcbd41fbd4, 0x76f988da831153b5, 0x983e5152ee66dfab,
+    0xa831c66d2db43210, 0xb00327c898fb213f, 0xbf597fc7beef0ee4, 0xc6e00bf33da88fc2, 0xd5a79147930aa725,
+    0x06ca6351e003826f, 0x142929670a0e6e70, 0x27b70a8546d22ffc, 0x2e1b21385c26c926, 0x4d2c6dfc5ac42aed,
+    0x53380d139d95b3df, 0x650a73548baf63de, 0x766a0abb3c77b2a8, 0x81c2c92e47edaee6, 0x92722c851482353b,
+    0xa2bfe8a14cf10364, 0xa81a664bbc423001, 0xc24b8b70d0f89791, 0xc76c51a30654be30, 0xd192e819d6ef5218,
+    0xd69906245565a910, 0xf40e35855771202a, 0x106aa07032bbd1b8, 0x19a4c116b8d2d0c8, 0x1e376c085141ab53,
+    0x2748774cdf8eeb99, 0x34b0bcb5e19b48a8, 0x391c0cb3c5c95a63, 0x4ed8aa4ae3418acb, 0x5b9cca4f7763e373,
+    0x682e6ff3d6b2b8a3, 0x748f82ee5defb2fc, 0x78a5636f43172f60, 0x84c87814a1f0ab72, 0x8cc702081a6439ec,
+    0x90befffa23631e28, 0xa4506cebde82bde9, 0xbef9a3f7b2c67915, 0xc67178f2e372532b, 0xca273eceea26619c,
+    0xd186b8c721c0c207, 0xeada7dd6cde0eb1e, 0xf57d4f7fee6ed178, 0x06f067aa72176fba, 0x0a637dc5a2c898a6,
+    0x113f9804bef90dae, 0x1b710b35131c471b, 0x28db77f523047d84, 0x32caab7b40c72493, 0x3c9ebe0a15c9bebc,
+    0x431d67c49c100d4c, 0x4cc5d4becb3e42b6, 0x597f299cfc657e2a, 0x5fcb6fab3ad6faec, 0x6c44198c4a475817,
+};
+
+constexpr std::uint64_t SHA512_IV[8] = {
+    0x6a09e667f3bcc908, 0xbb67ae8584caa73b, 0x3c6ef372fe94f82b, 0xa54ff53a5f1d36f1,
+    0x510e527fade682d1, 0x9b05688c2b3e6c1f, 0x1f83d9abfb41bd6b, 0x5be0cd19137e2179,
+};
+
+inline std::uint64_t ror64(std::uint64_t x, int n) { return (x >> n) | (x << (64 - n)); }
+
+inline std::uint64_t load_be64(const std::uint8_t *p) {
+    return (static_cast<std::uint64_t>(load_be32(p)) << 32) | load_be32(p + 4);
+}
+
+inline void store_be64(std::uint8_t *p, std::uint64_t v) {
+    store_be32(p, static_cast<std::uint32_t>(v >> 32));
+    store_be32(p + 4, static_cast<std::uint32_t>(v));
+}
+
+void sha512_blocks(std::uint64_t *h, const std::uint8_t *p, std::size_t n) {
+    for (; n; --n, p += 128) {
+        std::uint64_t w[80];
+        for (int i = 0; i < 16; ++i)
+            w[i] = load_be64(p + 8 * i);
+        for (int i = 16; i < 80; ++i) {
+            std::uint64_t s0 = ror64(w[i - 15], 1) ^ ror64(w[i - 15], 8) ^ (w[i - 15] >> 7);
+            std::uint64_t s1 = ror64(w[i - 2], 19) ^ ror64(w[i - 2], 61) ^ (w[i - 2] >> 6);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        std::uint64_t a = h[0], b = h[1], c = h[2], d = h[3];
+        std::uint64_t e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 80; ++i) {
+            std::uint64_t t1 = hh + (ror64(e, 14) ^ ror64(e, 18) ^ ror64(e, 41)) + ((e & f) ^ (~e & g)) +
+                               SHA512_K[i] + w[i];
+            std::uint64_t t2 = (ror64(a, 28) ^ ror64(a, 34) ^ ror64(a, 39)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+        h[5] += f;
+        h[6] += g;
+        h[7] += hh;
+    }
+}
+
+} // namespace
+
+void sha512_init(sha512_ctx &ctx) {
+    std::memset(&ctx, 0, sizeof(ctx));
+    std::memcpy(ctx.h, SHA512_IV, sizeof(SHA512_IV));
+}
+
+void sha512_update(sha512_ctx &ctx, const void *data, std::size_t len) {
+    auto p = static_cast<const std::uint8_t *>(data);
+    std::size_t used = ctx.len % 128;
+    ctx.len += len;
+    if (used) {
+        std::size_t take = std::min(len, 128 - used);
+        std::memcpy(ctx.buf + used, p, take);
+        p += take;
+        len -= take;
+        if (used + take < 128)
+            return;
+        sha512_blocks(ctx.h, ctx.buf, 1);
+    }
+    if (std::size_t n = len / 128) {
+        sha512_blocks(ctx.h, p, n);
+        p += n * 128;
+        len -= n * 128;
+    }
+    if (len)
+        std::memcpy(ctx.buf, p, len);
+}
+
+void sha512_final(sha512_ctx &ctx, std::uint8_t *out) {
+    std::uint64_t bits = ctx.len * 8;
+    std::size_t used = ctx.len % 128;
+    ctx.buf[used++] = 0x80;
+    if (used > 112) {
+        std::memset(ctx.buf + used, 0, 128 - used);
+        sha512_blocks(ctx.h, ctx.buf, 1);
+        used = 0;
+    }
+    // The length field is 128 bits; the high half is always zero here
+    std::memset(ctx.buf + used, 0, 120 - used);
+    store_be64(ctx.buf + 120, bits);
+    sha512_blocks(ctx.h, ctx.buf, 1);
+
+    for (int i = 0; i < 8; ++i)
+        store_be64(out + 8 * i, ctx.h[i]);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Built-in SHA-1 / SHA-256 / SHA-512 backing the SHA class when OpenSSL is not linked.
+// Blocks are hashed by the fastest kernel the CPU supports, picked once at runtime:
+// x86 SHA-NI, ARMv8 Crypto Extensions, or portable C.
+
+struct sha_ctx {
+    std::uint32_t h[8];
+    std::uint64_t len;
+    std::uint8_t buf[64];
+    bool sha256;
+};
+
+void sha_init(sha_ctx &ctx, bool sha256);
+void sha_update(sha_ctx &ctx, const void *data, std::size_t len);
+// Writes sha_digest_size(ctx) bytes to out.
+void sha_final(sha_ctx &ctx, std::uint8_t *out);
+std::size_t sha_digest_size(const sha_ctx &ctx);
+
+// Block kernels: hash n consecutive 64-byte blocks into h.
+using sha_blocks_fn = void (*)(std::uint32_t *h, const std::uint8_t *p, std::size_t n);
+
+void sha1_blocks_c(std::uint32_t *h, const std::uint8_t *p, std::size_t n);
+void sha256_blocks_c(std::uint32_t *h, const std::uint8_t *p, std::size_t n);
+
+// Built with the ISA flags they need (see CMakeLists.txt); only call after the
+// runtime check in sha.cpp.
+#ifdef USE_SHA_NI
+void sha1_blocks_shani(std::uint32_t *h, const std::uint8_t *p, std::size_t n);
+void sha256_blocks_shani(std::uint32_t *h, const std::uint8_t *p, std::size_t n);
+#endif
+#ifdef USE_SHA_ARMV8
+void sha1_blocks_armv8(std::uint32_t *h, const std::uint8_t *p, std::size_t n);
+void sha256_blocks_armv8(std::uint32_t *h, const std::uint8_t *p, std::size_t n);
+#endif
+
+extern const std::uint32_t SHA256_K[64];
+
+// SHA-512, portable C only; used for AVB descriptors and signatures.
+struct sha512_ctx {
+    std::uint64_t h[8];
+    std::uint64_t len;
+    std::uint8_t buf[128];
+};
+
+void sha512_init(sha512_ctx &ctx);
+void sha512_update(sha512_ctx &ctx, const void *data, std::size_t len);
+// Writes 64 bytes to out.
+void sha512_final(sha512_ctx &ctx, std::uint8_t *out);
@@ -0,0 +1,78 @@
+// SHA-1 / SHA-256 block kernels using the ARMv8 Crypto Extensions.
+// Built with -march=armv8-a+crypto; sha.cpp only dispatches here after checking HWCAP.
+
+#include <arm_neon.h>
+
+#include "sha.hpp"
+
+static inline uint32x4_t load_be128(const std::uint8_t *p) {
+    return vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p)));
+}
+
+void sha1_blocks_armv8(std::uint32_t *h, const std::uint8_t *p, std::size_t n) {
+    static constexpr std::uint32_t K[4] = {0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6};
+
+    uint32x4_t abcd = vld1q_u32(h);
+    std::uint32_t e0 = h[4];
+
+    for (; n; --n, p += 64) {
+        const uint32x4_t abcd_save = abcd;
+        std::uint32_t e = e0;
+        uint32x4_t m[4];
+
+        // Group g runs rounds 4g..4g+3; m[g % 4] holds message words 4g..4g+3
+        for (int g = 0; g < 20; ++g) {
+            uint32x4_t &w = m[g & 3];
+            if (g < 4)
+                w = load_be128(p + 16 * g);
+            else
+                w = vsha1su1q_u32(vsha1su0q_u32(w, m[(g + 1) & 3], m[(g + 2) & 3]), m[(g + 3) & 3]);
+
+            uint32x4_t wk = vaddq_u32(w, vdupq_n_u32(K[g / 5]));
+            std::uint32_t e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+            switch (g / 5) {
+            case 0: abcd = vsha1cq_u32(abcd, e, wk); break;
+            case 2: abcd = vsha1mq_u32(abcd, e, wk); break;
+            default: abcd = vsha1pq_u32(abcd, e, wk); break;
+            }
+            e = e_next;
+        }
+
+        abcd = vaddq_u32(abcd, abcd_save);
+        e0 += e;
+    }
+
+    vst1q_u32(h, abcd);
+    h[4] = e0;
+}
+
+void sha256_blocks_armv8(std::uint32_t *h, const std::uint8_t *p, std::size_t n) {
+    uint32x4_t s0 = vld1q_u32(h);
+    uint32x4_t s1 = vld1q_u32(h + 4);
+
+    for (; n; --n, p += 64) {
+        const uint32x4_t s0_save = s0;
+        const uint32x4_t s1_save = s1;
+        uint32x4_t m[4];
+
+        // Group g runs rounds 4g..4g+3; m[g % 4] holds message words 4g..4g+3
+        for (int g = 0; g < 16; ++g) {
+            uint32x4_t &w = m[g & 3];
+            if (g < 4)
+                w = load_be128(p + 16 * g);
+            else
+                w = vsha256su1q_u32(vsha256su0q_u32(w, m[(g + 1) & 3]), m[(g + 2) & 3], m[(g + 3) & 3]);
+
+            uint32x4_t wk = vaddq_u32(w, vld1q_u32(SHA256_K + 4 * g));
+            uint32x4_t tmp = s0;
+            s0 = vsha256hq_u32(s0, s1, wk);
+            s1 = vsha256h2q_u32(s1, tmp, wk);
+        }
+
+        s0 = vaddq_u32(s0, s0_save);
+        s1 = vaddq_u32(s1, s1_save);
+    }
+
+    vst1q_u32(h, s0);
+    vst1q_u32(h + 4, s1);
+}
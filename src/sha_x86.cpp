@@ -0,0 +1,87 @@
+// SHA-1 / SHA-256 block kernels using the x86 SHA extensions (SHA-NI).
+// Built with -msha -msse4.1; sha.cpp only dispatches here after checking CPUID.
+
+#include <immintrin.h>
+
+#include "sha.hpp"
+
+void sha1_blocks_shani(std::uint32_t *h, const std::uint8_t *p, std::size_t n) {
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607LL, 0x08090a0b0c0d0e0fLL);
+
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(h)), 0x1b);
+    __m128i e0 = _mm_set_epi32(static_cast<int>(h[4]), 0, 0, 0);
+
+    for (; n; --n, p += 64) {
+        const __m128i abcd_save = abcd;
+        const __m128i e0_save = e0;
+        __m128i m[4], e = e0, e_next;
+
+        // Group g runs rounds 4g..4g+3; m[g % 4] holds message words 4g..4g+3
+#pragma GCC unroll 20
+        for (int g = 0; g < 20; ++g) {
+            __m128i &w = m[g & 3];
+            if (g < 4) {
+                w = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * g)), mask);
+            } else {
+                w = _mm_sha1msg1_epu32(w, m[(g + 1) & 3]);
+                w = _mm_xor_si128(w, m[(g + 2) & 3]);
+                w = _mm_sha1msg2_epu32(w, m[(g + 3) & 3]);
+            }
+            e = g == 0 ? _mm_add_epi32(e, w) : _mm_sha1nexte_epu32(e, w);
+            e_next = abcd;
+            switch (g / 5) {
+            case 0: abcd = _mm_sha1rnds4_epu32(abcd, e, 0); break;
+            case 1: abcd = _mm_sha1rnds4_epu32(abcd, e, 1); break;
+            case 2: abcd = _mm_sha1rnds4_epu32(abcd, e, 2); break;
+            default: abcd = _mm_sha1rnds4_epu32(abcd, e, 3); break;
+            }
+            e = e_next;
+        }
+
+        e0 = _mm_sha1nexte_epu32(e, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(h), _mm_shuffle_epi32(abcd, 0x1b));
+    h[4] = static_cast<std::uint32_t>(_mm_extract_epi32(e0, 3));
+}
+
+void sha256_blocks_shani(std::uint32_t *h, const std::uint8_t *p, std::size_t n) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+
+    // The rounds instruction works on the state as ABEF / CDGH
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(h)), 0xb1);
+    __m128i s1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(h + 4)), 0x1b);
+    __m128i s0 = _mm_alignr_epi8(tmp, s1, 8);
+    s1 = _mm_blend_epi16(s1, tmp, 0xf0);
+
+    for (; n; --n, p += 64) {
+        const __m128i s0_save = s0;
+        const __m128i s1_save = s1;
+        __m128i m[4];
+
+        // Group g runs rounds 4g..4g+3; m[g % 4] holds message words 4g..4g+3
+#pragma GCC unroll 16
+        for (int g = 0; g < 16; ++g) {
+            __m128i &w = m[g & 3];
+            if (g < 4) {
+                w = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * g)), mask);
+            } else {
+                w = _mm_sha256msg1_epu32(w, m[(g + 1) & 3]);
+                w = _mm_add_epi32(w, _mm_alignr_epi8(m[(g + 3) & 3], m[(g + 2) & 3], 4));
+                w = _mm_sha256msg2_epu32(w, m[(g + 3) & 3]);
+            }
+            __m128i wk = _mm_add_epi32(w, _mm_loadu_si128(reinterpret_cast<const __m128i *>(SHA256_K + 4 * g)));
+            s1 = _mm_sha256rnds2_epu32(s1, s0, wk);
+            s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(wk, 0x0e));
+        }
+
+        s0 = _mm_add_epi32(s0, s0_save);
+        s1 = _mm_add_epi32(s1, s1_save);
+    }
+
+    tmp = _mm_shuffle_epi32(s0, 0x1b);
+    s1 = _mm_shuffle_epi32(s1, 0xb1);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(h), _mm_blend_epi16(tmp, s1, 0xf0));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(h + 4), _mm_alignr_epi8(s1, tmp, 8));
+}